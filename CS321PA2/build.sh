@@ -1 +1,4 @@
-gcc disasm.c -o disasm
+# zstd inputs are only supported when libzstd is installed
+ZSTD=""
+if [ -f /usr/include/zstd.h ]; then ZSTD="-DHAVE_ZSTD -lzstd"; fi
+gcc -O2 -pthread disasm.c -o disasm -lz $ZSTD
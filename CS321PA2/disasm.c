@@ -8,16 +8,56 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <endian.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <zlib.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <time.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef union {
 	uint32_t i;
 	float f;
 } intfloat;
 
+typedef union {
+	uint64_t i;
+	double f;
+} intdouble;
+
+// ids for every instruction the tool knows about, so the emulator
+// can dispatch on an integer instead of comparing mnemonics
+enum {
+	OP_INVALID,
+	OP_ADD, OP_ADDI, OP_ADDIS, OP_ADDS, OP_AND, OP_ANDI, OP_ANDIS, OP_ANDS,
+	OP_B, OP_BL, OP_BCOND, OP_BR, OP_CBNZ, OP_CBZ, OP_DUMP, OP_EOR, OP_EORI,
+	OP_FADDD, OP_FADDS, OP_FCMPD, OP_FCMPS, OP_FDIVD, OP_FDIVS, OP_FMULD,
+	OP_FMULS, OP_FSUBD, OP_FSUBS, OP_HALT, OP_LDUR, OP_LDURB, OP_LDURD,
+	OP_LDURH, OP_LDURS, OP_LDURSW, OP_LSL, OP_LSR, OP_MUL, OP_ORR, OP_ORRI,
+	OP_PRNL, OP_PRNT, OP_SDIV, OP_SMULH, OP_STUR, OP_STURB, OP_STURD,
+	OP_STURH, OP_STURS, OP_STURSW, OP_SUB, OP_SUBI, OP_SUBIS, OP_SUBS,
+	OP_UDIV, OP_UMULH
+};
+
+// shamt: value of bits [15-10] for instructions that share their
+// opcode with others (SDIV/UDIV, FP arithmetic), -1 if the opcode
+// alone decides. an instruction without one takes every shamt value
+// none of the others claim
 typedef struct {
 	char mnemonic[10];
 	void (*function)();
 	uint32_t opcode;
+	int id;
+	int shamt;
 } instruction_t;
 
 // absolute location is the index
@@ -29,100 +69,592 @@ typedef struct {
 
 // counter for current line
 int instruction_counter;
-// list array of instructions
-char *instruction_list[1000] = {NULL};
+// list array of instructions, sized from the input file
+char **instruction_list;
 // for tracking of branch labels and their names
+// branches[n-1] is "labeln", labels are numbered in address order
 int branch_counter;
-//branch_label* branches;
-branch_label branches[30];
+branch_label *branches;
+// one bit per instruction index 0..num_words that some branch targets,
+// and the number of targets before each 64-bit word of the bitmap.
+// the label in front of instruction i is its rank among the targets
+uint64_t *target_bits;
+int *target_rank;
+// label strings made so far (branches[n].label for n below it), and
+// the number of branches whose target is outside the program
+int labels_named;
+int outside_branches;
+// set when marking branches adds a target nobody pointed at before
+int labels_changed;
+// per instruction index: branches targeting it, only kept by --watch
+// so targets can be unmarked again
+int *target_refs;
+// per instruction: index of the instruction it branches to, or NO_TARGET
+#define NO_TARGET -1
+int *branch_target;
+// per instruction: label number of a branch that has no rank to look
+// up, i.e. its target is outside the program or there is no bitmap
+int *label_ref;
+
+// control-flow graph over words[]: block b covers instructions
+// block_start[b] up to block_start[b+1], edges are kept CSR style
+// (successors of b are succ[succ_offset[b]] to succ[succ_offset[b+1]-1])
+int num_blocks;
+int *block_start;
+int *block_of;
+int *succ_offset;
+int *succ;
+int *pred_offset;
+int *pred;
+// cross references: instructions branching to instruction i are
+// xref[xref_offset[i]] to xref[xref_offset[i+1]-1]
+int *xref_offset;
+int *xref;
+
+// emulator memory: flat main memory with the stack at the top end
+#define MAIN_MEMORY_SIZE 4096
+#define STACK_SIZE 512
+#define MEMORY_SIZE (MAIN_MEMORY_SIZE + STACK_SIZE)
+
+// --trace file layout: this header, then one record per executed
+// instruction. a record starts with a varint head,
+// zigzag(pc - (previous pc + 1)) << 3 | TRACE_REG | TRACE_STORE | TRACE_FLAGS,
+// so straight-line code costs one byte. then, as the head says:
+// the register written (0-31 X, 32-63 D) and zigzag(new - old value), zigzag(address -
+// previous store address) and the bytes stored, and NZCV in one byte
+#define TRACE_MAGIC "LV8TRACE"
+#define TRACE_REG 1
+#define TRACE_STORE 2
+#define TRACE_FLAGS 4
+typedef struct {
+	char magic[8];
+	int32_t num_words;
+	uint32_t program_hash;
+	int32_t pc;
+	int32_t flags;
+	int64_t X[32];
+	uint64_t D[32];
+} trace_header;
+
+// the emulator fills TRACE_BLOCK byte blocks and hands full ones to a
+// flusher thread, TRACE_RING blocks in total. handing over happens
+// once per block, so a mutex is cheap and lets the flusher sleep
+#define TRACE_BLOCK (1 << 20)
+#define TRACE_RING 4
+#define TRACE_RECORD_MAX 48
+typedef struct trace_writer {
+	unsigned char *blocks[TRACE_RING];
+	long lengths[TRACE_RING];
+	unsigned head;
+	unsigned tail;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned char *block;
+	long used;
+	int64_t regs[64];
+	int flags;
+	int last_pc;
+	int64_t last_address;
+	int fd;
+	int failed;
+	pthread_t thread;
+} trace_writer;
+
+// state of an emulated LEGv8 machine
+// pc is the index of the next instruction in words[], the program the
+// machine runs (the global one unless --batch gave it its own).
+// out gets PRNT/PRNL/DUMP output, err runtime errors. trace records
+// every instruction when --trace is on, NULL otherwise.
+// D holds the raw bits of the FP registers, S registers being the
+// low half of the D register with the same number as on ARMv8
+typedef struct {
+	int64_t X[32];
+	uint64_t D[32];
+	int N, Z, C, V;
+	int pc;
+	uint8_t *memory;
+	long memory_size;
+	int memory_mapped;
+	uint64_t executed;
+	uint64_t limit;
+	uint32_t *words;
+	uint8_t *op_ids;
+	int num_words;
+	FILE *out;
+	FILE *err;
+	trace_writer *trace;
+} machine_t;
+
+// --batch: one task per program in a list file, spread over worker
+// threads. each worker owns a range of task numbers packed into one
+// word as (first << 32) | end. the owner takes tasks from the end,
+// a worker that runs out steals the first half of another's range
+#define BATCH_BUDGET 100000000
+typedef struct {
+	char *path;
+	uint64_t budget;
+	int status;
+	uint64_t executed;
+	char *output;
+	size_t output_length;
+} batch_task;
+
+typedef struct {
+	_Alignas(64) _Atomic uint64_t range;
+} batch_queue;
+
+typedef struct {
+	batch_task *tasks;
+	batch_queue *queues;
+	int workers;
+	int self;
+} batch_worker;
+
+// ways a batch task can end
+#define BATCH_HALTED 0
+#define BATCH_FAILED 1
+#define BATCH_OUT_OF_BUDGET 2
+
+// checkpoint file layout: this header padded out to whole pages
+// (checkpoint_header_size), followed by the machine memory so it can
+// be mapped back directly
+#define CHECKPOINT_MAGIC "LV8CKPT"
+typedef struct {
+	char magic[8];
+	int32_t pc;
+	int32_t num_words;
+	uint32_t program_hash;
+	int32_t N, Z, C, V;
+	int64_t X[32];
+	uint64_t executed;
+	int64_t memory_size;
+	uint64_t D[32];
+} checkpoint_header;
+
+// direct lookup from the first 11 bits of a word to its index in
+// instruction[], -1 if no opcode matches. opcodes shared by several
+// instructions hold -2 - g instead: shared_table[g][shamt] decides
+#define MAX_SHARED 8
+int opcode_table[2048];
+int shared_table[MAX_SHARED][64];
+// per instruction[] index: bits that are zero in every encoding of it.
+// a word with any of them set is data, listing it as the instruction
+// would drop those bits
+uint32_t reserved_mask[64];
+
+// pipelined listing: batches of words move from the reader to the
+// decoder, formatter and writer threads through single producer /
+// single consumer rings. PIPE_RING batches exist in total, so a slow
+// stage stalls the ones in front of it once they run out
+#define PIPE_BATCH 4096
+#define PIPE_RING 16
+#define PIPE_LINE 64
+typedef struct {
+	int start;
+	int count;
+	uint32_t words[PIPE_BATCH];
+	int found[PIPE_BATCH];
+	int length;
+	char text[PIPE_BATCH * 2 * PIPE_LINE];
+} pipe_batch;
+
+typedef struct {
+	pipe_batch *slots[PIPE_RING];
+	_Atomic unsigned head;
+	_Atomic unsigned tail;
+} spsc_ring;
+
+typedef struct {
+	uint32_t *program;
+	int count;
+	spsc_ring free_batches;
+	spsc_ring to_decode;
+	spsc_ring to_format;
+	spsc_ring to_write;
+} pipeline;
+
+// one thread's share of a listing written with -o
+typedef struct {
+	uint32_t *program;
+	int start;
+	int end;
+	long length;
+	char *out;
+	long *page_lengths;
+} output_chunk;
+
+// formatted text of recently seen non-branch words, one direct mapped
+// table per thread so no locking is needed. an entry is one cache line;
+// length 0 marks an empty slot
+#define MEMO_SLOTS 2048
+#define MEMO_TEXT 58
+typedef struct {
+	uint32_t word;
+	uint16_t length;
+	char text[MEMO_TEXT];
+} memo_entry;
+_Thread_local memo_entry *memo;
+_Thread_local uint64_t memo_hits;
+_Thread_local uint64_t memo_misses;
+// totals of every thread that has finished formatting
+_Atomic uint64_t memo_total_hits;
+_Atomic uint64_t memo_total_misses;
+
+// --watch keeps a hash of every WATCH_PAGE bytes of the input and only
+// re-reads branches on pages whose hash changed
+#define WATCH_PAGE 4096
+
+// annotated listing: "00000010:  8b030041  " in front of each
+// instruction, byte offset then raw word
+#define ANNOTATE_WIDTH 21
+
+// bytes per read() when the input is a pipe or stdin
+#define STREAM_BUFFER (4 << 20)
+
+// ways of getting a regular file into memory: a plain read-only
+// mapping with readahead hints, the same prefaulted with MAP_POPULATE,
+// or pread into an anonymous (huge page backed) buffer. auto picks
+// between the first two by size
+#define IO_AUTO 0
+#define IO_MMAP 1
+#define IO_POPULATE 2
+#define IO_PREAD 3
+#define LARGE_INPUT (64L << 20)
+#define PREAD_BUFFER (16L << 20)
+
+// compressed inputs are inflated on their own thread into a pipe,
+// which the rest of the program then reads like any other stream
+#define COMPRESSED_NONE 0
+#define COMPRESSED_GZIP 1
+#define COMPRESSED_ZSTD 2
+typedef struct {
+	int format;
+	int in_fd;
+	unsigned char *in;
+	long in_size;
+	unsigned char prefix[4];
+	long prefix_len;
+	int out_fd;
+	int failed;
+	pthread_t thread;
+} decompress_job;
+decompress_job *input_job;
+
+// byte order of the input words: 0 big-endian (the LEGv8 default),
+// 1 little-endian, -1 until picked from --endian or by looking at the file
+int input_little_endian = -1;
+
+// loops over raw input words are written once inside BY_INPUT_ORDER and
+// compiled twice, once per byte order. little_endian is a constant in
+// each copy, so LOAD_WORD turns into a plain swap or nothing at all
+#define LOAD_WORD(x) (little_endian ? le32toh(x) : be32toh(x))
+#define BY_INPUT_ORDER(...) \
+	if (input_little_endian == 1) { \
+		const int little_endian = 1; \
+		__VA_ARGS__ \
+	} else { \
+		const int little_endian = 0; \
+		__VA_ARGS__ \
+	}
+
+// operand fields a --find pattern can set
+#define FIELD_RD 1
+#define FIELD_RN 2
+#define FIELD_RM 4
+#define FIELD_IMM 8
+
+// instruction level diff of two images. sequences are compared with
+// Myers' O(ND) algorithm, first as basic block hashes, then instruction
+// by instruction inside blocks that changed. past DIFF_MAX_D edits a
+// region is reported as replaced instead
+#define DIFF_MAX_D 2000
+#define EDIT_EQUAL 0
+#define EDIT_DELETE 1
+#define EDIT_INSERT 2
+typedef struct {
+	int op;
+	int a;
+	int b;
+} edit_t;
+
+// one decoded image: host-order words, a comparison key per instruction
+// (the word, with branch offsets masked out), target index per
+// instruction and basic block boundaries with hashes
+typedef struct {
+	uint32_t *words;
+	int count;
+	uint64_t *keys;
+	int *targets;
+	int num_blocks;
+	int *block_start;
+	uint64_t *block_hash;
+} diff_image;
+
+// decoded program: host-order words and instruction id per word,
+// both indexed the same as the instruction lines before labels
+uint32_t *words;
+uint8_t *op_ids;
+int num_words;
 
 // declare functions
-void decode_instruction(intfloat inp_inst, int num_opcodes);
+int decode_instruction(intfloat inp_inst, int num_opcodes);
+int format_instruction(intfloat inp_inst, int idx, char *out);
+int format_word(uint32_t w, int found, int idx, char *out);
+int format_line(uint32_t w, int found, int i, char *columns, char *text);
+void memo_release();
+void print_memo_stats();
+int branch_offset(uint32_t w, int id);
+void scan_branches(uint32_t *program, int count);
+void mark_branches(uint32_t *program, int start, int end);
+void number_labels(int count);
 void insert_branches();
-void insert_instruction_index(char instr[], int idx);
 void insert_instruction(char instr[]);
-void insert_label(branch_label branch, uint32_t idx);
-int binary_search(intfloat opcode, int left, int right);
+int label_at(int i);
+int find_opcode(uint32_t w);
+uint32_t reserved_bits(int id);
+int is_d_format(int id);
+char register_prefix(int id);
+int label_for(int idx);
+void build_opcode_table(int num_opcodes);
 
 // LEGv8 format instructions:
-void r_format(intfloat inp_inst, instruction_t instr);
-void i_format(intfloat inp_inst, instruction_t instr);
-void b_format(intfloat inp_inst, instruction_t instr);
-void cb_format(intfloat inp_inst, instruction_t instr);
-void d_format(intfloat inp_inst, instruction_t instr);
+void r_format(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void i_format(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void b_format(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void cb_format(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void d_format(intfloat inp_inst, instruction_t instr, int idx, char *out);
+
+// control-flow graph and cross references:
+int ends_block(int i);
+void build_cfg();
+void print_cfg_dot();
+void print_cfg_json();
+void annotate_xrefs();
+void reg_use_def(int i, uint32_t *use, uint32_t *def);
+int liveness_report();
+
+// raw word search:
+int opcode_length(int id);
+int pattern_fields(int id);
+int compile_pattern(char *pattern, int num_opcodes, uint32_t *mask, uint32_t *value);
+void find_pattern(uint32_t *program, long count, uint32_t mask, uint32_t value, int num_opcodes);
+void print_match(uint32_t *program, long i, int num_opcodes);
+
+// pipelined listing:
+void ring_push(spsc_ring *ring, pipe_batch *batch);
+pipe_batch *ring_pop(spsc_ring *ring);
+void *pipe_reader(void *arg);
+void *pipe_decoder(void *arg);
+void *pipe_formatter(void *arg);
+void *pipe_writer(void *arg);
+void run_pipeline(uint32_t *program, int count);
+
+// parallel output file:
+void *measure_chunk(void *arg);
+void *write_chunk(void *arg);
+int write_listing(uint32_t *program, int count, char *path, long *page_lengths);
+
+// watch mode:
+uint64_t page_hash(uint32_t *program, long size, long page);
+int unmark_branches(int start, int end, int *unreferenced);
+int patch_listing(char *path, uint32_t *program, long *dirty, long num_dirty, long *page_lengths, long pages);
+int watch_listing(char *path, char *output_file, uint32_t *program, long size, int fd);
+
+// annotated listing:
+void hex_encode(uint32_t *values, int count, char *out);
+void print_annotated(uint32_t *program, int count);
+
+// instruction mix:
+void *histogram_chunk(void *arg);
+void count_histogram(uint32_t *program, long count, int num_opcodes, uint64_t *totals);
+int stream_histogram(int fd, char *prefix, long prefix_len, int num_opcodes, uint64_t *totals, uint64_t *count);
+void print_histogram(uint64_t *totals, uint64_t count, int num_opcodes);
+
+// input:
+long read_fully(int fd, char *data, long len);
+uint32_t *read_program(int fd, char *prefix, long prefix_len, long *size);
+uint32_t *load_file(int fd, long size, int backend);
+void close_input(uint32_t *program, long size, int mapped, int fd);
+void pick_input_order(uint32_t *program, long count);
+int guess_little_endian(uint32_t *program, long count);
+int compression_format(unsigned char *data, long len);
+long next_compressed(decompress_job *job, unsigned char *buffer, long len);
+int write_fully(int fd, unsigned char *data, long len);
+void *decompress_input(void *arg);
+int start_decompress(int format, int fd, unsigned char *in, long in_size, unsigned char *prefix, long prefix_len);
+int finish_decompress();
+
+// image diff:
+int load_diff_image(char *path, diff_image *image);
+int diff_keys(uint64_t *a, int n, uint64_t *b, int m, edit_t **script);
+int edit_run(edit_t *script, int count, int e, int *deletes, int *inserts);
+void print_diff(diff_image *a, diff_image *b, edit_t *script, int count, int *totals);
+int diff_images(char *path_a, char *path_b);
 
 // other util functions:
-void sort_branches();
 int partition(int first, int last);
 void quick_sort(int first, int last);
 void float_bits(intfloat i);
 void get_format(intfloat i);
 
+// emulator and profiler:
+void init_machine(machine_t *m);
+int run_program(machine_t *m, uint64_t *counts);
+int access_size(int id);
+uint64_t fp_single_op(int id, uint64_t n_bits, uint64_t m_bits);
+uint64_t fp_double_op(int id, uint64_t n_bits, uint64_t m_bits);
+void fp_compare(machine_t *m, double a, double b);
+void dump_machine(machine_t *m);
+void free_machine(machine_t *m);
+void profile_report(uint64_t *counts);
+uint32_t program_hash();
+long page_round(long size);
+long checkpoint_header_size();
+int save_checkpoint(machine_t *m, char *path);
+int restore_checkpoint(machine_t *m, char *path);
+
+// execution trace:
+int machine_flags(machine_t *m);
+uint64_t zigzag(int64_t v);
+int64_t unzigzag(uint64_t v);
+int put_varint(unsigned char *out, uint64_t v);
+long get_varint(unsigned char *data, long len, long pos, uint64_t *v);
+trace_writer *trace_open(char *path, machine_t *m);
+void trace_step(machine_t *m, int pc, int64_t address);
+void trace_hand_over(trace_writer *t);
+void *trace_flusher(void *arg);
+int trace_close(trace_writer *t);
+int print_trace(char *path);
+
+// batch runs:
+int run_batch(char *list_path, uint64_t budget);
+void *batch_worker_run(void *arg);
+int batch_take(batch_queue *queue);
+int batch_steal(batch_worker *worker);
+void run_batch_task(batch_task *task);
+
 // methods for specific instances of required instructions
 // these call their respective LEGv8 instruction type or format
-void ADD_inst(intfloat inp_inst, instruction_t instr);
-void ADDI_inst(intfloat inp_inst, instruction_t instr);
-void AND_inst(intfloat inp_inst, instruction_t instr);
-void ANDI_inst(intfloat inp_inst, instruction_t instr);
-void B_inst(intfloat inp_inst, instruction_t instr);
-void B_cond(intfloat inp_inst, instruction_t instr);
-void BL_inst(intfloat inp_inst, instruction_t instr);
-void BR_inst(intfloat inp_inst, instruction_t instr);
-void CBNZ_inst(intfloat inp_inst, instruction_t instr);
-void CBZ_inst(intfloat inp_inst, instruction_t instr);
-void DUMP_inst(intfloat inp_inst, instruction_t instr);
-void EOR_inst(intfloat inp_inst, instruction_t instr);
-void EORI_inst(intfloat inp_inst, instruction_t instr);
-void HALT_inst(intfloat inp_inst, instruction_t instr);
-void LDUR_inst(intfloat inp_inst, instruction_t instr);
-void LSL_inst(intfloat inp_inst, instruction_t instr);
-void LSR_inst(intfloat inp_inst, instruction_t instr);
-void MUL_inst(intfloat inp_inst, instruction_t instr);
-void ORR_inst(intfloat inp_inst, instruction_t instr);
-void ORRI_inst(intfloat inp_inst, instruction_t instr);
-void PRNL_inst(intfloat inp_inst, instruction_t instr);
-void PRNT_inst(intfloat inp_inst, instruction_t instr);
-void STUR_inst(intfloat inp_inst, instruction_t instr);
-void SUB_inst(intfloat inp_inst, instruction_t instr);
-void SUBI_inst(intfloat inp_inst, instruction_t instr);
-void SUBIS_inst(intfloat inp_inst, instruction_t instr);
-void SUBS_inst(intfloat inp_inst, instruction_t instr);
+void ADD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ADDI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ADDIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ADDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void AND_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ANDI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ANDIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ANDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void B_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void BL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void B_cond(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void BR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void CBNZ_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void CBZ_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void DUMP_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void EOR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void EORI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FADDD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FADDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FCMPD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FCMPS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FDIVD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FDIVS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FMULD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FMULS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FSUBD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void FSUBS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void HALT_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDUR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDURB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDURD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDURH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDURS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LDURSW_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LSL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void LSR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void MUL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ORR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void ORRI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void PRNL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void PRNT_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SDIV_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SMULH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STUR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STURB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STURD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STURH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STURS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void STURW_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SUB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SUBI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SUBIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void SUBS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void UDIV_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
+void UMULH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out);
 
 // LEGv8 "B.cond" instruction suffix array. Maps hexadecimal to strings
-const char* b_suffix[14] = {
+const char* b_suffix[16] = {
 	"EQ", "NE", "HS", "LO", "MI", "PL", "VS", "VC",
-	"HI", "LS", "GE", "LT", "GT", "LE"
+	"HI", "LS", "GE", "LT", "GT", "LE", "AL", "NV"
 };
 
 // LEGv8 opcodes for needed instructions:
 instruction_t instruction[] = {
-  { "ADD",     ADD_inst,    0b10001011000 },
-  { "ADDI",    ADDI_inst,   0b1001000100  },
-  { "AND",     AND_inst,    0b10001010000 },
-  { "ANDI",    ANDI_inst,   0b1001001000  },
-  { "B",       B_inst,      0b000101      },
-  { "BL",      BL_inst,     0b100101      },
-  { "B.",      B_cond,      0b01010100    },
-  { "BR",      BR_inst,     0b11010110000 },
-  { "CBNZ",    CBNZ_inst,   0b10110101    },
-  { "CBZ",     CBZ_inst,    0b10110100    },
-  { "DUMP",    DUMP_inst,   0b11111111110 },
-  { "EOR",     EOR_inst,    0b11001010000 },
-  { "EORI",    EORI_inst,   0b1101001000  },
-  { "HALT",    HALT_inst,   0b11111111111 },
-  { "LDUR",    LDUR_inst,   0b11111000010 },
-  { "LSL",     LSL_inst,    0b11010011011 },
-  { "LSR",     LSR_inst,    0b11010011010 },
-  { "MUL",     MUL_inst,    0b10011011000 },
-  { "ORR",     ORR_inst,    0b10101010000 },
-  { "ORRI",    ORRI_inst,   0b1011001000  },
-  { "PRNL",    PRNL_inst,   0b11111111100 },
-  { "PRNT",    PRNT_inst,   0b11111111101 },
-  { "STUR",    STUR_inst,   0b11111000000 },
-  { "SUB",     SUB_inst,    0b11001011000 },
-  { "SUBI",    SUBI_inst,   0b1101000100  },
-  { "SUBIS",   SUBIS_inst,  0b1111000100  },
-  { "SUBS",    SUBS_inst,   0b11101011000 }
+  { "ADD",     ADD_inst,    0b10001011000, OP_ADD,    -1 },
+  { "ADDI",    ADDI_inst,   0b1001000100,  OP_ADDI,   -1 },
+  { "ADDIS",   ADDIS_inst,  0b1011000100,  OP_ADDIS,  -1 },
+  { "ADDS",    ADDS_inst,   0b10101011000, OP_ADDS,   -1 },
+  { "AND",     AND_inst,    0b10001010000, OP_AND,    -1 },
+  { "ANDI",    ANDI_inst,   0b1001001000,  OP_ANDI,   -1 },
+  { "ANDIS",   ANDIS_inst,  0b1111001000,  OP_ANDIS,  -1 },
+  { "ANDS",    ANDS_inst,   0b01110101000, OP_ANDS,   -1 },
+  { "B",       B_inst,      0b000101,      OP_B,      -1 },
+  { "BL",      BL_inst,     0b100101,      OP_BL,     -1 },
+  { "B.",      B_cond,      0b01010100,    OP_BCOND,  -1 },
+  { "BR",      BR_inst,     0b11010110000, OP_BR,     -1 },
+  { "CBNZ",    CBNZ_inst,   0b10110101,    OP_CBNZ,   -1 },
+  { "CBZ",     CBZ_inst,    0b10110100,    OP_CBZ,    -1 },
+  { "DUMP",    DUMP_inst,   0b11111111110, OP_DUMP,   -1 },
+  { "EOR",     EOR_inst,    0b11001010000, OP_EOR,    -1 },
+  { "EORI",    EORI_inst,   0b1101001000,  OP_EORI,   -1 },
+  { "FADDD",   FADDD_inst,  0b00011110011, OP_FADDD,  0b001010 },
+  { "FADDS",   FADDS_inst,  0b00011110001, OP_FADDS,  0b001010 },
+  { "FCMPD",   FCMPD_inst,  0b00011110011, OP_FCMPD,  0b001000 },
+  { "FCMPS",   FCMPS_inst,  0b00011110001, OP_FCMPS,  0b001000 },
+  { "FDIVD",   FDIVD_inst,  0b00011110011, OP_FDIVD,  0b000110 },
+  { "FDIVS",   FDIVS_inst,  0b00011110001, OP_FDIVS,  0b000110 },
+  { "FMULD",   FMULD_inst,  0b00011110011, OP_FMULD,  0b000010 },
+  { "FMULS",   FMULS_inst,  0b00011110001, OP_FMULS,  0b000010 },
+  { "FSUBD",   FSUBD_inst,  0b00011110011, OP_FSUBD,  0b001110 },
+  { "FSUBS",   FSUBS_inst,  0b00011110001, OP_FSUBS,  0b001110 },
+  { "HALT",    HALT_inst,   0b11111111111, OP_HALT,   -1 },
+  { "LDUR",    LDUR_inst,   0b11111000010, OP_LDUR,   -1 },
+  { "LDURB",   LDURB_inst,  0b00111000010, OP_LDURB,  -1 },
+  { "LDURD",   LDURD_inst,  0b11111100010, OP_LDURD,  -1 },
+  { "LDURH",   LDURH_inst,  0b01111000010, OP_LDURH,  -1 },
+  { "LDURS",   LDURS_inst,  0b10111100010, OP_LDURS,  -1 },
+  { "LDURSW",  LDURSW_inst, 0b10111000100, OP_LDURSW, -1 },
+  { "LSL",     LSL_inst,    0b11010011011, OP_LSL,    -1 },
+  { "LSR",     LSR_inst,    0b11010011010, OP_LSR,    -1 },
+  { "MUL",     MUL_inst,    0b10011011000, OP_MUL,    -1 },
+  { "ORR",     ORR_inst,    0b10101010000, OP_ORR,    -1 },
+  { "ORRI",    ORRI_inst,   0b1011001000,  OP_ORRI,   -1 },
+  { "PRNL",    PRNL_inst,   0b11111111100, OP_PRNL,   -1 },
+  { "PRNT",    PRNT_inst,   0b11111111101, OP_PRNT,   -1 },
+  { "SDIV",    SDIV_inst,   0b10011010110, OP_SDIV,   -1 },
+  { "SMULH",   SMULH_inst,  0b10011011010, OP_SMULH,  -1 },
+  { "STUR",    STUR_inst,   0b11111000000, OP_STUR,   -1 },
+  { "STURB",   STURB_inst,  0b00111000000, OP_STURB,  -1 },
+  { "STURD",   STURD_inst,  0b11111100000, OP_STURD,  -1 },
+  { "STURH",   STURH_inst,  0b01111000000, OP_STURH,  -1 },
+  { "STURS",   STURS_inst,  0b10111100000, OP_STURS,  -1 },
+  { "STURSW",  STURW_inst,  0b10111000000, OP_STURSW, -1 },
+  { "SUB",     SUB_inst,    0b11001011000, OP_SUB,    -1 },
+  { "SUBI",    SUBI_inst,   0b1101000100,  OP_SUBI,   -1 },
+  { "SUBIS",   SUBIS_inst,  0b1111000100,  OP_SUBIS,  -1 },
+  { "SUBS",    SUBS_inst,   0b11101011000, OP_SUBS,   -1 },
+  { "UDIV",    UDIV_inst,   0b10011010110, OP_UDIV,   0b000011 },
+  { "UMULH",   UMULH_inst,  0b10011011110, OP_UMULH,  -1 }
 };
 
 
@@ -130,59 +662,383 @@ int main(int argc, char *argv[]) {
 	int fd;
 	struct stat buf;
 	uint32_t *program;
+	char *input_file = NULL;
+	int run_mode = 0;
+	int profile_mode = 0;
+	char *checkpoint_file = NULL;
+	uint64_t checkpoint_at = 0;
+	char *restore_file = NULL;
+	char *cfg_format = NULL;
+	int xrefs_mode = 0;
+	int liveness_mode = 0;
+	char *find = NULL;
+	int histogram_mode = 0;
+	int pipeline_mode = 0;
+	char *output_file = NULL;
+	int io_backend = IO_AUTO;
+	char *diff_a = NULL;
+	int watch_mode = 0;
+	int annotate_mode = 0;
+	char *diff_b = NULL;
+	char *batch_list = NULL;
+	char *trace_file = NULL;
+	char *show_trace = NULL;
+	uint64_t batch_budget = BATCH_BUDGET;
+	
+	// read options, anything else is the input file
+	for (int a = 1; a < argc; a++) {
+		if (strcmp(argv[a], "--run") == 0) {
+			run_mode = 1;
+		} else if (strcmp(argv[a], "--profile") == 0) {
+			run_mode = 1;
+			profile_mode = 1;
+		} else if (strcmp(argv[a], "--checkpoint") == 0 && a + 2 < argc) {
+			run_mode = 1;
+			checkpoint_at = strtoull(argv[a+1], NULL, 10);
+			checkpoint_file = argv[a+2];
+			a += 2;
+		} else if (strcmp(argv[a], "--restore") == 0 && a + 1 < argc) {
+			run_mode = 1;
+			restore_file = argv[++a];
+		} else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+			run_mode = 1;
+			trace_file = argv[++a];
+		} else if (strcmp(argv[a], "--show-trace") == 0 && a + 1 < argc) {
+			show_trace = argv[++a];
+		} else if (strcmp(argv[a], "--cfg") == 0 && a + 1 < argc) {
+			cfg_format = argv[++a];
+		} else if (strcmp(argv[a], "--xrefs") == 0) {
+			xrefs_mode = 1;
+		} else if (strcmp(argv[a], "--liveness") == 0) {
+			liveness_mode = 1;
+		} else if (strcmp(argv[a], "--find") == 0 && a + 1 < argc) {
+			find = argv[++a];
+		} else if (strcmp(argv[a], "--histogram") == 0) {
+			histogram_mode = 1;
+		} else if (strcmp(argv[a], "--watch") == 0) {
+			watch_mode = 1;
+		} else if (strcmp(argv[a], "--stats") == 0) {
+			// printed on the way out, whichever mode returns
+			atexit(print_memo_stats);
+		} else if (strcmp(argv[a], "--annotate") == 0) {
+			annotate_mode = 1;
+		} else if (strcmp(argv[a], "--pipeline") == 0) {
+			pipeline_mode = 1;
+		} else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+			output_file = argv[++a];
+		} else if (strcmp(argv[a], "--diff") == 0 && a + 2 < argc) {
+			diff_a = argv[a+1];
+			diff_b = argv[a+2];
+			a += 2;
+		} else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc) {
+			batch_list = argv[++a];
+		} else if (strcmp(argv[a], "--budget") == 0 && a + 1 < argc) {
+			batch_budget = strtoull(argv[++a], NULL, 10);
+		} else if (strcmp(argv[a], "--endian") == 0 && a + 1 < argc) {
+			a++;
+			if (strcmp(argv[a], "big") == 0) {
+				input_little_endian = 0;
+			} else if (strcmp(argv[a], "little") == 0) {
+				input_little_endian = 1;
+			} else if (strcmp(argv[a], "auto") != 0) {
+				input_file = NULL;
+				break;
+			}
+		} else if (strcmp(argv[a], "--io") == 0 && a + 1 < argc) {
+			a++;
+			if (strcmp(argv[a], "mmap") == 0) {
+				io_backend = IO_MMAP;
+			} else if (strcmp(argv[a], "populate") == 0) {
+				io_backend = IO_POPULATE;
+			} else if (strcmp(argv[a], "pread") == 0) {
+				io_backend = IO_PREAD;
+			} else if (strcmp(argv[a], "auto") != 0) {
+				input_file = NULL;
+				break;
+			}
+		} else if (input_file == NULL) {
+			input_file = argv[a];
+		} else {
+			input_file = NULL;
+			break;
+		}
+	}
+
+	int num_opcodes = sizeof(instruction) / sizeof(instruction[0]);
 	
+	// sort opcodes, then index them by their first 11 bits
+	// so each lookup is a single table read
+	quick_sort(0, num_opcodes -1);
+	build_opcode_table(num_opcodes);
+
+	// compare two images instead of listing one
+	if (diff_a != NULL) {
+		return diff_images(diff_a, diff_b);
+	}
+
+	// run many programs side by side instead of listing one
+	if (batch_list != NULL) {
+		return run_batch(batch_list, batch_budget);
+	}
+
 	// check for correct # of arguments
-	if (argc != 2) {
-		printf("%s <input_file> \n", argv[0]);
+	if (input_file == NULL) {
+		printf("%s <input_file> [--run] [--profile] [--checkpoint <count> <file>] [--restore <file>] [--trace <file>] [--show-trace <file>] [--cfg dot|json] [--xrefs] [--liveness] [--find <pattern>] [--histogram] [--pipeline] [--annotate] [--stats] [--watch -o <output_file>] [-o <output_file>] [--io auto|mmap|populate|pread] [--endian auto|big|little]\n", argv[0]);
+		printf("%s --diff <old_file> <new_file>\n", argv[0]);
+		printf("%s --batch <list_file> [--budget <count>] [--endian auto|big|little]\n", argv[0]);
+		printf("use - as <input_file> to read standard input\n");
 		return 1;
 	}
 
-	// try to open file
-	fd = open(argv[1], O_RDONLY);
+	// try to open file, "-" is standard input
+	if (strcmp(input_file, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(input_file, O_RDONLY);
+	}
 	if (fd == -1) {
 		perror("Error reading file");
 		return 1;
 	}
 	
 	// file information
-	fstat(fd, &buf);
+	if (fstat(fd, &buf) == -1) {
+		perror("Error reading file");
+		close(fd);
+		return 1;
+	}
+	// reading a directory only fails later, after the buffers are set up
+	if (S_ISDIR(buf.st_mode)) {
+		printf("Error reading file: %s is a directory\n", input_file);
+		close(fd);
+		return 1;
+	}
 
-	// allocate memory for file contents
-	//program = malloc(buf.st_size);
 	// map contents of the file into memory,
 	// accessible through 'program' pointer
-	program = mmap(
-			NULL,
-			buf.st_size,
-			PROT_READ | PROT_WRITE,
-			MAP_PRIVATE,
-			fd,
-			0
-		       );
+	// pipes and terminals can't be mapped, those are read instead
+	long program_size = buf.st_size;
+	int program_mapped = 0;
+	program = MAP_FAILED;
+	if (S_ISREG(buf.st_mode) && buf.st_size > 0) {
+		program = load_file(fd, buf.st_size, io_backend);
+	}
+	if (program != MAP_FAILED) {
+		program_mapped = 1;
+	}
 
-	int num_opcodes = sizeof(instruction) / sizeof(instruction[0]);
-	
-	// sort opcodes for lookup time of O(log n) with binary search
-	// might implement a hashtable if time
-	quick_sort(0, num_opcodes -1);
+	// compressed input: decompress on another thread and read the
+	// result through a pipe, so inflating overlaps with decoding
+	unsigned char prefix[4];
+	long prefix_len = 0;
+	int compression;
+	if (program_mapped) {
+		compression = compression_format((unsigned char *)program, program_size);
+	} else {
+		prefix_len = read_fully(fd, (char *)prefix, 4);
+		if (prefix_len < 0) {
+			close_input(NULL, 0, 0, fd);
+			return 1;
+		}
+		compression = compression_format(prefix, prefix_len);
+	}
+	if (compression != COMPRESSED_NONE) {
+		int pipe_fd = start_decompress(compression, fd,
+				program_mapped ? (unsigned char *)program : NULL, program_size,
+				prefix, prefix_len);
+		if (pipe_fd == -1) {
+			close_input(program_mapped ? program : NULL, program_size, program_mapped, fd);
+			return 1;
+		}
+		fd = pipe_fd;
+		program = NULL;
+		program_mapped = 0;
+		prefix_len = 0;
+	}
+
+	// count mnemonics straight from the raw words, nothing is stored
+	if (histogram_mode) {
+		uint64_t *totals = calloc(num_opcodes + 1, sizeof(uint64_t));
+		uint64_t count = program_size / 4;
+		int failed = 0;
+		if (program_mapped) {
+			pick_input_order(program, count);
+			count_histogram(program, count, num_opcodes, totals);
+		} else {
+			failed = stream_histogram(fd, (char *)prefix, prefix_len, num_opcodes, totals, &count);
+		}
+		failed |= finish_decompress();
+		if (!failed) {
+			print_histogram(totals, count, num_opcodes);
+		}
+		free(totals);
+		close_input(program_mapped ? program : NULL, program_size, program_mapped, fd);
+		return failed;
+	}
+
+	// everything else needs the whole program in memory
+	if (!program_mapped) {
+		program = read_program(fd, (char *)prefix, prefix_len, &program_size);
+		if (finish_decompress() != 0 && program != NULL) {
+			free(program);
+			program = NULL;
+		}
+		if (program == NULL) {
+			close_input(NULL, 0, 0, fd);
+			return 1;
+		}
+	}
+	num_words = program_size / 4;
+	pick_input_order(program, program_size / 4);
+
+	// search the raw words, only matches get decoded and printed,
+	// nothing is allocated per word. unlike the listing this isn't
+	// limited to int indexes
+	if (find != NULL) {
+		uint32_t mask, value;
+		int status = compile_pattern(find, num_opcodes, &mask, &value);
+		if (status == 0) {
+			find_pattern(program, program_size / 4, mask, value, num_opcodes);
+		}
+		close_input(program, program_size, program_mapped, fd);
+		return status;
+	}
+
+	words = malloc(num_words * sizeof(uint32_t) + 1);
+	op_ids = malloc(num_words + 1);
+	instruction_list = malloc((num_words + 1) * sizeof(char *));
+	branches = malloc((num_words + 1) * sizeof(branch_label));
+	branch_target = malloc((num_words + 1) * sizeof(int));
+	label_ref = calloc(num_words + 1, sizeof(int));
+	for (int i = 0; i < num_words; i++) {
+		branch_target[i] = NO_TARGET;
+	}
+
+	scan_branches(program, num_words);
+
+	// offset and raw word columns in front of every instruction
+	if (annotate_mode) {
+		print_annotated(program, num_words);
+		close_input(program, program_size, program_mapped, fd);
+		return 0;
+	}
+
+	// keep the output file up to date with the input until interrupted
+	if (watch_mode) {
+		if (output_file == NULL || !program_mapped) {
+			printf("--watch needs a regular input file and -o <output_file>\n");
+			close_input(program, program_size, program_mapped, fd);
+			return 1;
+		}
+		return watch_listing(input_file, output_file, program, program_size, fd);
+	}
+
+	// every thread formats its own part straight into the output file
+	if (output_file != NULL) {
+		int status = write_listing(program, num_words, output_file, NULL);
+		close_input(program, program_size, program_mapped, fd);
+		return status;
+	}
+
+	// stream the listing through the reader/decoder/formatter/writer threads
+	if (pipeline_mode) {
+		run_pipeline(program, num_words);
+		close_input(program, program_size, program_mapped, fd);
+		return 0;
+	}
 
 	// convert to 32 bit int
-	for (int i = 0; i < (buf.st_size / 4); i++) {
-		uint32_t temp = be32toh(program[i]);
+	BY_INPUT_ORDER(
+	for (int i = 0; i < num_words; i++) {
+		uint32_t temp = LOAD_WORD(program[i]);
 		intfloat t;
 	        t.i = temp;
 		//float_bits(t);
-		decode_instruction(t, num_opcodes);
+		int idx = decode_instruction(t, num_opcodes);
+		words[i] = temp;
+		op_ids[i] = (idx > -1) ? instruction[idx].id : OP_INVALID;
 	}
+	)
 
-	if (program == NULL) {
-		perror("Program is null");
-		close(fd);
-		return 1;
+	// replay a recorded run against the listing
+	if (show_trace != NULL) {
+		int status = print_trace(show_trace);
+		close_input(program, program_size, program_mapped, fd);
+		return status;
+	}
+
+	if (cfg_format != NULL || xrefs_mode || liveness_mode) {
+		build_cfg();
+	}
+
+	// lint: report dead register writes instead of the listing
+	if (liveness_mode) {
+		int status = liveness_report();
+		close_input(program, program_size, program_mapped, fd);
+		return status;
+	}
+
+	// print only the graph when asked for it
+	if (cfg_format != NULL) {
+		if (strcmp(cfg_format, "json") == 0) {
+			print_cfg_json();
+		} else {
+			print_cfg_dot();
+		}
+		close_input(program, program_size, program_mapped, fd);
+		return 0;
+	}
+
+	// name the callers of every label in its declaration
+	if (xrefs_mode) {
+		annotate_xrefs();
 	}
 	
-	// NOTE: UNCOMMENT THESE TO SHOW LABELS IN OUTPUT
-	sort_branches();
+	// execute the program, keeping one counter per instruction
+	// when profiling so the listing can show where time went
+	if (run_mode) {
+		machine_t m;
+		uint64_t *counts = NULL;
+		if (profile_mode) {
+			counts = calloc(num_words + 1, sizeof(uint64_t));
+		}
+		if (restore_file != NULL) {
+			if (restore_checkpoint(&m, restore_file) != 0) {
+				close_input(program, program_size, program_mapped, fd);
+				return 1;
+			}
+		} else {
+			init_machine(&m);
+		}
+		// stop after the requested prefix and save it for later runs
+		if (checkpoint_file != NULL) {
+			m.limit = checkpoint_at;
+		}
+		if (trace_file != NULL) {
+			m.trace = trace_open(trace_file, &m);
+			if (m.trace == NULL) {
+				free_machine(&m);
+				close_input(program, program_size, program_mapped, fd);
+				return 1;
+			}
+		}
+		int status = run_program(&m, counts);
+		if (m.trace != NULL && trace_close(m.trace) != 0) {
+			status = 1;
+		}
+		if (status == 0 && checkpoint_file != NULL) {
+			status = save_checkpoint(&m, checkpoint_file);
+		}
+		if (!profile_mode) {
+			free_machine(&m);
+			close_input(program, program_size, program_mapped, fd);
+			return status;
+		}
+		profile_report(counts);
+		free_machine(&m);
+		free(counts);
+	}
+
 	// insert the branch labels as final editing of output
 	insert_branches();
 	
@@ -192,69 +1048,254 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	munmap(program, buf.st_size);
-	close(fd);
+	close_input(program, program_size, program_mapped, fd);
 
 	return 0;
 } // end main()
 
 // break instruction into first 11 bits, retrieve the instance of this instruction
-void decode_instruction(intfloat inp_inst, int num_opcodes) {
-	intfloat opcode;
+// and add its text to the end of instruction_list
+// returns: index in instruction or -1 if not found
+int decode_instruction(intfloat inp_inst, int num_opcodes) {
+	char str[64];
+	int idx_found = format_instruction(inp_inst, instruction_counter, str);
+	insert_instruction(str);
+	return idx_found;
+}
 
-	// try increasingly longer opcodes
-	opcode.i = inp_inst.i >> 26; // first 6 bits to check for B-type
-	int idx_found = binary_search(opcode, 0, num_opcodes-1);
-	
-	// check if 6 bit opcode found, otherwise search for 8 bit opcode
-	if (idx_found == -1) {
-		opcode.i = inp_inst.i >> 24; // first 8 bits for CB-type
-		idx_found = binary_search(opcode, 0, num_opcodes-1);
+// write the text of the instruction at index idx into out
+// returns: index in instruction or -1 if not found
+int format_instruction(intfloat inp_inst, int idx, char *out) {
+	int idx_found = find_opcode(inp_inst.i);
+	format_word(inp_inst.i, idx_found, idx, out);
+	return idx_found;
+}
+
+// write the text of word w at index idx into out, NUL terminated.
+// everything but branches reads the same wherever it is, so those
+// come out of this thread's memo table after the first time
+// found: index in instruction of the word, already looked up
+// returns: length of the text
+int format_word(uint32_t w, int found, int idx, char *out) {
+	int id = (found > -1) ? instruction[found].id : OP_INVALID;
+	if (id == OP_B || id == OP_BL || id == OP_BCOND || id == OP_CBZ || id == OP_CBNZ) {
+		intfloat t;
+		t.i = w;
+		instruction[found].function(t, instruction[found], idx, out);
+		return strlen(out);
 	}
-	// check if 8 bit opcode found, otherwise search for 10 bit opcode
-	if (idx_found == -1) {
-		opcode.i = inp_inst.i >> 22; // first 10 bit opcodes for I-type
-		idx_found = binary_search(opcode, 0, num_opcodes-1);
+
+	// aligned so every entry really is one cache line
+	if (memo == NULL) {
+		memo = aligned_alloc(64, MEMO_SLOTS * sizeof(memo_entry));
+		memset(memo, 0, MEMO_SLOTS * sizeof(memo_entry));
 	}
-	// check if 10 bit opcode found, otherwise search for 11 bit opcode
-	if (idx_found == -1) {
-		opcode.i = inp_inst.i >> 21;
-		idx_found = binary_search(opcode, 0, num_opcodes-1);
+	memo_entry *entry = &memo[(w * 2654435761u) >> 21];
+	if (entry->word == w && entry->length != 0) {
+		memcpy(out, entry->text, entry->length + 1);
+		memo_hits++;
+		return entry->length;
 	}
-	
-	// if idx >= 0 then success, call output function of LEGv8 instruction
-	if (idx_found > -1) {
-		instruction_t inst_found = instruction[idx_found];
-		// call instance function
-		inst_found.function(inp_inst, inst_found);
-	} else { // the instruction was not found
-		printf("ERROR instruction not found in opcodes\n");
-	}	
+	memo_misses++;
+
+	// if found >= 0 then success, call output function of LEGv8 instruction
+	if (found > -1) {
+		intfloat t;
+		t.i = w;
+		instruction[found].function(t, instruction[found], idx, out);
+	} else { // not an instruction: data, written back out as it was
+		// so the line stays parallel to words[]
+		sprintf(out, ".word 0x%08x", w);
+	}
+
+	int length = strlen(out);
+	if (length < MEMO_TEXT) {
+		entry->word = w;
+		entry->length = length;
+		memcpy(entry->text, out, length + 1);
+	}
+	return length;
 }
 
-// insert branch declarations into correct spots
-void insert_branches() {
-	for (int i = 0; i < branch_counter; i++) {
-		branch_label temp_branch = branches[i];
-		
-		// adjust absolute index of labels to account for shifting
-		temp_branch.absolute_index += i;
-		
-		// call insert_instruction with absolute_index
-		insert_instruction_index(temp_branch.label, temp_branch.absolute_index);
+// add this thread's memo counters to the totals and drop its table,
+// for every thread that formats when it is done
+void memo_release() {
+	atomic_fetch_add(&memo_total_hits, memo_hits);
+	atomic_fetch_add(&memo_total_misses, memo_misses);
+	memo_hits = 0;
+	memo_misses = 0;
+	free(memo);
+	memo = NULL;
+}
+
+// print how often formatted text came out of the memo tables
+void print_memo_stats() {
+	memo_release();
+	uint64_t hits = atomic_load(&memo_total_hits);
+	uint64_t lookups = hits + atomic_load(&memo_total_misses);
+	fprintf(stderr, "format memo: %lu hits of %lu lookups (%.1f%%)\n", hits, lookups,
+			(lookups != 0) ? 100.0 * hits / lookups : 0.0);
+}
+
+// write the listing line(s) for word w at index i into text: its label
+// if it has one, the instruction, and the label past the end of the
+// program after the last instruction
+// found: index in instruction of the word, already looked up
+// columns: ANNOTATE_WIDTH characters put in front of the instruction, or NULL
+// returns: number of characters written, without a terminating NUL
+int format_line(uint32_t w, int found, int i, char *columns, char *text) {
+	char *start = text;
+	int label = label_at(i);
+	if (label != 0) {
+		text += sprintf(text, "%s\n", branches[label - 1].label);
+	}
+	if (columns != NULL) {
+		memcpy(text, columns, ANNOTATE_WIDTH);
+		text += ANNOTATE_WIDTH;
 	}
+
+	text += format_word(w, found, i, text);
+	*text++ = '\n';
+
+	if (i == num_words - 1 && label_at(num_words) != 0) {
+		text += sprintf(text, "%s\n", branches[label_at(num_words) - 1].label);
+	}
+	return text - start;
 }
 
-void insert_instruction_index(char instr[], int idx) {
-	//instruction_counter++;
-	instruction_list[instruction_counter+1] = malloc(strlen(instr) + 20);
-	
-	for (int i = instruction_counter; i >= idx; i--) {
-		instruction_list[i] = instruction_list[i-1];	
+// relative target of a branch word in instructions, sign extended
+int branch_offset(uint32_t w, int id) {
+	int relative;
+	if (id == OP_B || id == OP_BL) {
+		relative = w & 0x03FFFFFF;
+		// handling for signed address (negatives)
+		if (relative & 0x02000000) {
+			relative |= ~0x03FFFFFF;
+		}
+	} else {
+		relative = (w >> 5) & 0x7FFFF;
+		if (relative & 0x40000) {
+			relative |= ~0x7FFFF;
+		}
 	}
-	instruction_list[idx-1] = instr;
-	
-	instruction_counter++;
+	return relative;
+}
+
+// one pass over the raw words marking every branch target, then
+// labels are numbered by address: label n names the nth target, so a
+// name only changes when targets in front of it do. after this the
+// formatting of a word only depends on the word and its index
+void scan_branches(uint32_t *program, int count) {
+	int chunks = count / 64 + 1;
+	target_bits = calloc(chunks, sizeof(uint64_t));
+	target_rank = malloc(chunks * sizeof(int));
+	mark_branches(program, 0, count);
+	number_labels(count);
+}
+
+// mark the targets of the branches among words start..end-1 in the
+// bitmap (and target_refs when it is kept), or count them as outside
+void mark_branches(uint32_t *program, int start, int end) {
+	BY_INPUT_ORDER(
+	for (int i = start; i < end; i++) {
+		uint32_t w = LOAD_WORD(program[i]);
+		int idx = find_opcode(w);
+		if (idx < 0) {
+			continue;
+		}
+		int id = instruction[idx].id;
+		if (id == OP_B || id == OP_BL || id == OP_BCOND || id == OP_CBZ || id == OP_CBNZ) {
+			int target = i + branch_offset(w, id);
+			if (target >= 0 && target <= num_words) {
+				uint64_t bit = 1ull << (target & 63);
+				labels_changed |= (target_bits[target >> 6] & bit) == 0;
+				branch_target[i] = target;
+				target_bits[target >> 6] |= bit;
+				if (target_refs != NULL) {
+					target_refs[target]++;
+				}
+			} else {
+				// numbered by number_labels
+				label_ref[i] = 1;
+				outside_branches++;
+			}
+		}
+	}
+	)
+}
+
+// number the marked targets in address order: the rank in front of every
+// bitmap word and the label list, then the branches to targets outside
+// the program, which get a name after all declared labels
+void number_labels(int count) {
+	int chunks = count / 64 + 1;
+
+	branch_counter = 0;
+	for (int c = 0; c < chunks; c++) {
+		target_rank[c] = branch_counter;
+		uint64_t bits = target_bits[c];
+		while (bits != 0) {
+			branch_label *branch = &branches[branch_counter];
+			branch->absolute_index = c * 64 + __builtin_ctzll(bits) + 1;
+			// the name only depends on the number, so it is made once
+			if (branch_counter == labels_named) {
+				branch->label = malloc(20);
+				sprintf(branch->label, "label%d:", branch_counter + 1);
+				labels_named++;
+			}
+			branch_counter++;
+			bits &= bits - 1;
+		}
+	}
+
+	if (outside_branches > 0) {
+		int n = branch_counter;
+		for (int i = 0; i < count; i++) {
+			if (branch_target[i] == NO_TARGET && label_ref[i] != 0) {
+				label_ref[i] = ++n;
+			}
+		}
+	}
+}
+
+// label number declared in front of instruction i, 0 if none
+int label_at(int i) {
+	uint64_t bit = 1ull << (i & 63);
+	uint64_t bits = target_bits[i >> 6];
+	if ((bits & bit) == 0) {
+		return 0;
+	}
+	return target_rank[i >> 6] + __builtin_popcountll(bits & (bit - 1)) + 1;
+}
+
+// label number the branch at idx refers to
+int label_for(int idx) {
+	if (target_bits == NULL || branch_target[idx] == NO_TARGET) {
+		return label_ref[idx];
+	}
+	return label_at(branch_target[idx]);
+}
+
+// insert branch declarations into correct spots
+// one pass merging label lines in front of the instructions they name
+void insert_branches() {
+	char **merged = malloc((instruction_counter + branch_counter + 1) * sizeof(char *));
+	int count = 0;
+
+	for (int i = 0; i <= instruction_counter; i++) {
+		// labels past the last instruction still get declared at the end
+		int label = (i <= num_words) ? label_at(i) : 0;
+		if (label != 0) {
+			merged[count++] = branches[label - 1].label;
+		}
+		if (i < instruction_counter) {
+			merged[count++] = instruction_list[i];
+		}
+	}
+
+	free(instruction_list);
+	instruction_list = merged;
+	instruction_counter = count;
 }
 
 void insert_instruction(char instr[]) {
@@ -269,42 +1310,133 @@ void insert_instruction(char instr[]) {
 	instruction_counter++;
 }
 
-// add label to list
-void insert_label(branch_label branch, uint32_t idx) {
-	// check branch is already declared (this is fine, no error)
-	for (int b = 0; b < branch_counter; b++) {
-	//	if (strcmp(branches[b].label, branch.label) == 1) {
-		if (branches[b].absolute_index == branch.absolute_index) {
-			return;
-		}
+// fill opcode_table from instruction[]. shorter opcodes cover every
+// 11-bit pattern they prefix and are written last, so they win
+// the same way the old 6, 8, 10, 11 bit search order did
+void build_opcode_table(int num_opcodes) {
+	for (int i = 0; i < 2048; i++) {
+		opcode_table[i] = -1;
 	}
-	
-	branches[branch_counter] = branch;
-	branch_counter++;
-}	
 
-// binary search to find index of instruction matching the opcode
-// returns: index in instruction or -1 else
-int binary_search(intfloat opcode, int left, int right) {
-	while (left <= right) {
-		int mid = left + (right - left) / 2;
-		
-		if (instruction[mid].opcode == opcode.i) {
-			return mid;
+	int lengths[4] = {11, 10, 8, 6};
+	for (int l = 0; l < 4; l++) {
+		for (int n = 0; n < num_opcodes; n++) {
+			int length = opcode_length(instruction[n].id);
+			if (length != lengths[l] || instruction[n].shamt != -1) {
+				continue;
+			}
+			int first = instruction[n].opcode << (11 - length);
+			for (int i = first; i < first + (1 << (11 - length)); i++) {
+				opcode_table[i] = n;
+			}
 		}
+	}
 
-		if (instruction[mid].opcode < opcode.i) {
-			left = mid + 1;
-		} else {
-			right = mid - 1;
+	// opcodes told apart by shamt get a second level, starting out as
+	// whatever the opcode alone decoded to
+	int groups = 0;
+	for (int n = 0; n < num_opcodes; n++) {
+		if (instruction[n].shamt == -1) {
+			continue;
+		}
+		int op = instruction[n].opcode;
+		if (opcode_table[op] > -2) {
+			for (int s = 0; s < 64; s++) {
+				shared_table[groups][s] = opcode_table[op];
+			}
+			opcode_table[op] = -2 - groups;
+			groups++;
 		}
+		shared_table[-2 - opcode_table[op]][instruction[n].shamt] = n;
 	}
-	return -1;
+
+	for (int n = 0; n < num_opcodes; n++) {
+		reserved_mask[n] = reserved_bits(instruction[n].id);
+	}
+}
+
+// fields an instruction doesn't use, which the assembler leaves zero
+// returns: mask of those bits
+uint32_t reserved_bits(int id) {
+	switch (id) {
+	case OP_ADD:
+	case OP_ADDS:
+	case OP_AND:
+	case OP_ANDS:
+	case OP_EOR:
+	case OP_ORR:
+	case OP_SUB:
+	case OP_SUBS:
+	case OP_MUL:
+	case OP_SMULH:
+	case OP_UMULH:
+		// shamt
+		return 0x0000FC00;
+	case OP_SDIV:
+		// shamt, except the green card's 2 (UDIV is 3)
+		return 0x0000F400;
+	case OP_LSL:
+	case OP_LSR:
+		// Rm
+		return 0x001F0000;
+	case OP_BR:
+		// Rm, shamt and Rd
+		return 0x001FFC1F;
+	case OP_FCMPS:
+	case OP_FCMPD:
+		// Rd
+		return 0x0000001F;
+	case OP_BCOND:
+		// the condition is only 4 bits of Rt
+		return 0x00000010;
+	case OP_PRNT:
+		// everything but Rd
+		return 0x001FFFE0;
+	case OP_PRNL:
+	case OP_DUMP:
+	case OP_HALT:
+		return 0x001FFFFF;
+	}
+	// op2
+	if (is_d_format(id)) {
+		return 0x00000C00;
+	}
+	return 0;
+}
+
+// loads and stores, which share the D-format layout
+int is_d_format(int id) {
+	switch (id) {
+	case OP_LDUR:
+	case OP_LDURB:
+	case OP_LDURD:
+	case OP_LDURH:
+	case OP_LDURS:
+	case OP_LDURSW:
+	case OP_STUR:
+	case OP_STURB:
+	case OP_STURD:
+	case OP_STURH:
+	case OP_STURS:
+	case OP_STURSW:
+		return 1;
+	}
+	return 0;
 }
 
-void r_format(intfloat inp_inst, instruction_t instr) {
-	char str[30];
+// index in instruction[] of word w, -1 if it isn't an instruction
+int find_opcode(uint32_t w) {
+	int idx = opcode_table[w >> 21];
+	if (idx < -1) {
+		idx = shared_table[-2 - idx][(w >> 10) & 0x3F];
+	}
+	if (idx > -1 && (w & reserved_mask[idx]) != 0) {
+		return -1;
+	}
+	return idx;
+}
 
+void r_format(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// opcode: first 11 bits [31-21]
 	
 	// Rm: second register source operand: 5 bits [20-16]
@@ -314,7 +1446,7 @@ void r_format(intfloat inp_inst, instruction_t instr) {
 
 	// shamt: shift amount: 6 bits [15-10]
 	intfloat shamt;
-	shamt.i = (inp_inst.i >> 10) & 0xF;
+	shamt.i = (inp_inst.i >> 10) & 0x3F;
 	//printf("%d ", shamt.i);
 
 	// Rn: first register source operand: 5 bits [9-5]
@@ -328,31 +1460,32 @@ void r_format(intfloat inp_inst, instruction_t instr) {
 	//printf("%d\n", Rd.i);
 	
 	if (strcmp(instr.mnemonic, "PRNT") == 0) {
-		sprintf(str, "%s X%d", instr.mnemonic, Rd.i);
-		insert_instruction(str);
+		sprintf(out, "%s X%d", instr.mnemonic, Rd.i);
 		return;
 	}
 
 	if (strcmp(instr.mnemonic, "BR") == 0) {
-		sprintf(str, "%s X%d", instr.mnemonic, Rn.i);
-		insert_instruction(str);
+		sprintf(out, "%s X%d", instr.mnemonic, Rn.i);
+		return;
+	}
+
+	// FP compares only have the two sources
+	char reg = register_prefix(instr.id);
+	if (instr.id == OP_FCMPS || instr.id == OP_FCMPD) {
+		sprintf(out, "%s %c%d, %c%d", instr.mnemonic, reg, Rn.i, reg, Rm.i);
 		return;
 	}
 
 	if (strcmp(instr.mnemonic, "LSL") == 0 || strcmp(instr.mnemonic, "LSR") == 0) {
-		sprintf(str, "%s X%d, X%d, #%d", instr.mnemonic, Rd.i, Rn.i, shamt.i);
+		sprintf(out, "%s X%d, X%d, #%d", instr.mnemonic, Rd.i, Rn.i, shamt.i);
 	} else {
-		sprintf(str, "%s X%d, X%d, X%d", instr.mnemonic, Rd.i, Rn.i, Rm.i);
+		sprintf(out, "%s %c%d, %c%d, %c%d", instr.mnemonic, reg, Rd.i, reg, Rn.i, reg, Rm.i);
 	}
 
 	//printf("X%d, X%d, X%d\n", Rd.i, Rn.i, Rm.i);
-
-	//printf("argument: %s\n", str); 
-	//printf("%d\n", instruction_counter);
-	insert_instruction(str);
 }
 
-void i_format(intfloat inp_inst, instruction_t instr) {
+void i_format(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// opcode: first 10 bits [31-22]
 	// immediate value: 12 bits [21-10]
 	intfloat immediate;
@@ -371,308 +1504,3443 @@ void i_format(intfloat inp_inst, instruction_t instr) {
 	
 	//printf("X%d, X%d, #%d\n", Rd.i, Rn.i, immediate.i);
 
-	char str[30];
-	sprintf(str, "%s X%d, X%d, #%d", instr.mnemonic, Rd.i, Rn.i, immediate.i);
-	insert_instruction(str);
+	sprintf(out, "%s X%d, X%d, #%d", instr.mnemonic, Rd.i, Rn.i, immediate.i);
 }
 
-// this method does two things:
-// 1) checks if the label is declared at: line number - offset, inserts label otherwise. In LEGv8: ```branch2:```
-// 2) inserts the actual instruction. in LEGv8: ```B branch2```
-void b_format(intfloat inp_inst, instruction_t instr) {
+// label numbers come from the targets scan_branches marked,
+// --find has no labels and prints the target index after the text
+// in LEGv8: ```B branch2```
+void b_format(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	//printf("B-format\n");
-	branch_label *temp_branch = malloc(sizeof(branch_label));
-	
-	// create instance of label and add it to the output array
-	char str_count[30];
-	char actual_instr[35];
-	int bc = branch_counter + 1;
-	sprintf(str_count, "label%d", bc);
-	sprintf(actual_instr, "%s %s", instr.mnemonic, str_count);
-	strcat(str_count, ":");
-	
-	temp_branch->label = malloc(strlen(str_count) + 1);
-	strcpy(temp_branch->label, str_count);
-	
-	// insert actual instruction (like: ```B loop2```)
-	// increment instruction counter (at the beginning?)
-	insert_instruction(actual_instr);
-
-	// calculate absolute_index (line number of "labeln:")
-	int relative = (inp_inst.i & 0x03FFFFFF);
-	// handling for signed address (negatives)
-	if (relative & 0x02000000) {
-		relative |= ~0x03FFFFFF;
+	if (label_ref == NULL) {
+		sprintf(out, "%s", instr.mnemonic);
+		return;
 	}
-
-	temp_branch->absolute_index = instruction_counter + relative;
-
-	// call with instruction_counter - relative_address
-	// absolute index is the line number of "label n:"
-	insert_label(*temp_branch, temp_branch->absolute_index);
+	sprintf(out, "%s label%d", instr.mnemonic, label_for(idx));
 }
 
-void cb_format(intfloat inp_inst, instruction_t instr) {
+void cb_format(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	//printf("CB-format\n");
-	intfloat COND_BR_address;
- 	COND_BR_address.i = (inp_inst.i >> 5) & 0x7FFFF;
-	
-	// handle negative address
-	if (COND_BR_address.i & 0x40000) {
-		COND_BR_address.i |= ~0x7FFFF;
-	}
-	
-	// add new branch if needed, similar to B-format
-	branch_label *temp_branch = malloc(sizeof(branch_label));
-
-	char str_count[30];
-	char actual_instr[35];
-	int bc = branch_counter + 1;
-	sprintf(str_count, "label%d", bc);
-	sprintf(actual_instr, "%s", str_count);
-	strcat(str_count, ":");
-	
-	temp_branch->label = malloc(strlen(str_count) + 1);
-	strcpy(temp_branch->label, str_count);
-	
 	intfloat Rt;
-	char str[50];
+	Rt.i = inp_inst.i & 0x1F;
 	
 	// check for B.cond instruction. diverge if so
 	if (strcmp(instr.mnemonic, "B.") == 0) {
-		Rt.i = inp_inst.i & 0x1F;
-		
-		sprintf(str, "%s%s %s", instr.mnemonic, b_suffix[Rt.i], actual_instr);
-		insert_instruction(str);
-		temp_branch->absolute_index = instruction_counter + COND_BR_address.i;
-		insert_label(*temp_branch, temp_branch->absolute_index);
+		if (label_ref == NULL) {
+			sprintf(out, "%s%s", instr.mnemonic, b_suffix[Rt.i]);
+			return;
+		}
+		sprintf(out, "%s%s label%d", instr.mnemonic, b_suffix[Rt.i], label_for(idx));
 		return;
 	}
 
 	// else: continue as normal
-	Rt.i = inp_inst.i & 0x1F;
-	sprintf(str, "%s X%d, %s", instr.mnemonic, Rt.i, actual_instr);
-
-	insert_instruction(str);
-
-	temp_branch->absolute_index = instruction_counter + COND_BR_address.i;
-	
-	insert_label(*temp_branch, temp_branch->absolute_index);
+	if (label_ref == NULL) {
+		sprintf(out, "%s X%d", instr.mnemonic, Rt.i);
+		return;
+	}
+	sprintf(out, "%s X%d, label%d", instr.mnemonic, Rt.i, label_for(idx));
 }
 
-void d_format(intfloat inp_inst, instruction_t instr) {
+void d_format(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	intfloat DT_address;
 	intfloat op;
 	intfloat Rn;
 	intfloat Rt;
 	
 	// LDUR X9, [X10, #240]
-	// DT_address: 9 bits [20-12]
+	// DT_address: 9 bits [20-12], signed
 	DT_address.i = (inp_inst.i >> 12) & 0x1FF;
+	if (DT_address.i & 0x100) {
+		DT_address.i |= ~0x1FF;
+	}
+
+	// op2/op: 2 bits [11-10]
+	op.i = (inp_inst.i >> 10) & 0x3;
+
+	// Rn: base register: 5 bits [9-5]
+	Rn.i = (inp_inst.i >> 5) & 0x1F;
+
+	// Rt destination/source register: 5 bits [4-0]
+	Rt.i = inp_inst.i & 0x1F;
+
+	// Rt is an FP register for LDURS/LDURD/STURS/STURD
+	sprintf(out, "%s %c%d, [X%d, #%d]", instr.mnemonic, register_prefix(instr.id), Rt.i, Rn.i, (int32_t)DT_address.i);
+}
+
+// register file an instruction's Rd/Rt (and FP sources) name:
+// S for single precision, D for double, X for everything else
+char register_prefix(int id) {
+	switch (id) {
+	case OP_FADDS:
+	case OP_FCMPS:
+	case OP_FDIVS:
+	case OP_FMULS:
+	case OP_FSUBS:
+	case OP_LDURS:
+	case OP_STURS:
+		return 'S';
+	case OP_FADDD:
+	case OP_FCMPD:
+	case OP_FDIVD:
+	case OP_FMULD:
+	case OP_FSUBD:
+	case OP_LDURD:
+	case OP_STURD:
+		return 'D';
+	}
+	return 'X';
+}
+
+// true when instruction i is the last one of its basic block
+int ends_block(int i) {
+	switch (op_ids[i]) {
+	case OP_B:
+	case OP_BL:
+	case OP_BCOND:
+	case OP_CBZ:
+	case OP_CBNZ:
+	case OP_BR:
+	case OP_HALT:
+		return 1;
+	}
+	return 0;
+}
+
+// split words[] into basic blocks and fill in the successor, predecessor
+// and cross reference arrays. every step is a linear pass or a counting
+// sort, so this is O(instructions + edges)
+void build_cfg() {
+	// leaders: first instruction, branch targets and whatever follows a block end
+	char *leader = calloc(num_words + 1, 1);
+	if (num_words > 0) {
+		leader[0] = 1;
+	}
+	for (int i = 0; i < num_words; i++) {
+		if (ends_block(i)) {
+			leader[i + 1] = 1;
+		}
+		if (branch_target[i] != NO_TARGET) {
+			leader[branch_target[i]] = 1;
+		}
+	}
+
+	num_blocks = 0;
+	for (int i = 0; i < num_words; i++) {
+		num_blocks += leader[i];
+	}
+	block_start = malloc((num_blocks + 1) * sizeof(int));
+	block_of = malloc((num_words + 1) * sizeof(int));
+	int b = -1;
+	for (int i = 0; i < num_words; i++) {
+		if (leader[i]) {
+			block_start[++b] = i;
+		}
+		block_of[i] = b;
+	}
+	block_start[num_blocks] = num_words;
+	free(leader);
+
+	// successors come from the last instruction of each block:
+	// at most a fall through edge and a branch edge, one edge when
+	// both go to the next block
+	succ_offset = malloc((num_blocks + 1) * sizeof(int));
+	succ = malloc((2 * num_blocks + 1) * sizeof(int));
+	int edges = 0;
+	for (b = 0; b < num_blocks; b++) {
+		int last = block_start[b + 1] - 1;
+		int op = op_ids[last];
+		int target = branch_target[last];
+
+		succ_offset[b] = edges;
+		int falls = op != OP_B && op != OP_BR && op != OP_HALT && last + 1 < num_words;
+		if (falls) {
+			succ[edges++] = b + 1;
+		}
+		if (target != NO_TARGET && target < num_words && !(falls && target == last + 1)) {
+			succ[edges++] = block_of[target];
+		}
+	}
+	succ_offset[num_blocks] = edges;
+
+	// predecessors: counting sort of the same edges by destination
+	pred_offset = calloc(num_blocks + 1, sizeof(int));
+	pred = malloc((edges + 1) * sizeof(int));
+	for (int e = 0; e < edges; e++) {
+		pred_offset[succ[e] + 1]++;
+	}
+	for (b = 0; b < num_blocks; b++) {
+		pred_offset[b + 1] += pred_offset[b];
+	}
+	int *fill = malloc((num_blocks + 1) * sizeof(int));
+	memcpy(fill, pred_offset, (num_blocks + 1) * sizeof(int));
+	for (b = 0; b < num_blocks; b++) {
+		for (int e = succ_offset[b]; e < succ_offset[b + 1]; e++) {
+			pred[fill[succ[e]]++] = b;
+		}
+	}
+	free(fill);
+
+	// cross references: every branch source grouped by target instruction
+	xref_offset = calloc(num_words + 2, sizeof(int));
+	for (int i = 0; i < num_words; i++) {
+		if (branch_target[i] != NO_TARGET) {
+			xref_offset[branch_target[i] + 1]++;
+		}
+	}
+	for (int i = 0; i <= num_words; i++) {
+		xref_offset[i + 1] += xref_offset[i];
+	}
+	xref = malloc((xref_offset[num_words + 1] + 1) * sizeof(int));
+	fill = malloc((num_words + 1) * sizeof(int));
+	memcpy(fill, xref_offset, (num_words + 1) * sizeof(int));
+	for (int i = 0; i < num_words; i++) {
+		if (branch_target[i] != NO_TARGET) {
+			xref[fill[branch_target[i]]++] = i;
+		}
+	}
+	free(fill);
+}
+
+// print the graph for graphviz, one node per block with its listing
+void print_cfg_dot() {
+	printf("digraph cfg {\n");
+	printf("\tnode [shape=box, fontname=\"monospace\"];\n");
+	for (int b = 0; b < num_blocks; b++) {
+		int start = block_start[b];
+		printf("\tb%d [label=\"", b);
+		if (label_at(start) != 0) {
+			printf("%s\\l", branches[label_at(start) - 1].label);
+		}
+		for (int i = start; i < block_start[b + 1]; i++) {
+			printf("%d: %s\\l", i, instruction_list[i]);
+		}
+		printf("\"];\n");
+	}
+	for (int b = 0; b < num_blocks; b++) {
+		for (int e = succ_offset[b]; e < succ_offset[b + 1]; e++) {
+			printf("\tb%d -> b%d;\n", b, succ[e]);
+		}
+	}
+	printf("}\n");
+}
+
+// print blocks with their edges, then every label with its sources
+void print_cfg_json() {
+	printf("{\n\"blocks\": [\n");
+	for (int b = 0; b < num_blocks; b++) {
+		int start = block_start[b];
+		printf("  {\"id\": %d, \"start\": %d, \"end\": %d", b, start, block_start[b + 1]);
+		if (label_at(start) != 0) {
+			printf(", \"label\": \"label%d\"", label_at(start));
+		}
+		printf(", \"succ\": [");
+		for (int e = succ_offset[b]; e < succ_offset[b + 1]; e++) {
+			printf("%s%d", (e > succ_offset[b]) ? ", " : "", succ[e]);
+		}
+		printf("], \"pred\": [");
+		for (int e = pred_offset[b]; e < pred_offset[b + 1]; e++) {
+			printf("%s%d", (e > pred_offset[b]) ? ", " : "", pred[e]);
+		}
+		printf("]}%s\n", (b + 1 < num_blocks) ? "," : "");
+	}
+	printf("],\n\"xrefs\": [\n");
+	for (int l = 0; l < branch_counter; l++) {
+		int target = branches[l].absolute_index - 1;
+		printf("  {\"label\": \"label%d\", \"target\": %d, \"sources\": [", l + 1, target);
+		for (int x = xref_offset[target]; x < xref_offset[target + 1]; x++) {
+			printf("%s%d", (x > xref_offset[target]) ? ", " : "", xref[x]);
+		}
+		printf("]}%s\n", (l + 1 < branch_counter) ? "," : "");
+	}
+	printf("]\n}\n");
+}
+
+// append the instructions that branch to each label to its declaration:
+// ```label3:    // from 4, 17```
+void annotate_xrefs() {
+	for (int l = 0; l < branch_counter; l++) {
+		int target = branches[l].absolute_index - 1;
+		int sources = xref_offset[target + 1] - xref_offset[target];
+		char *label = malloc(strlen(branches[l].label) + 16 + sources * 12);
+		int len = sprintf(label, "%s    // from", branches[l].label);
+
+		for (int x = xref_offset[target]; x < xref_offset[target + 1]; x++) {
+			len += sprintf(label + len, "%s %d", (x > xref_offset[target]) ? "," : "", xref[x]);
+		}
+		free(branches[l].label);
+		branches[l].label = label;
+	}
+}
+
+// registers read (use) and written (def) by instruction i, one bit per
+// register. XZR is left out since reading or writing it means nothing
+void reg_use_def(int i, uint32_t *use, uint32_t *def) {
+	uint32_t w = words[i];
+	uint32_t Rd = 1u << (w & 0x1F);
+	uint32_t Rn = 1u << ((w >> 5) & 0x1F);
+	uint32_t Rm = 1u << ((w >> 16) & 0x1F);
+
+	*use = 0;
+	*def = 0;
+	switch (op_ids[i]) {
+	case OP_ADD:
+	case OP_ADDS:
+	case OP_AND:
+	case OP_ANDS:
+	case OP_EOR:
+	case OP_ORR:
+	case OP_SUB:
+	case OP_SUBS:
+	case OP_MUL:
+	case OP_SDIV:
+	case OP_UDIV:
+	case OP_SMULH:
+	case OP_UMULH:
+		*use = Rn | Rm;
+		*def = Rd;
+		break;
+	case OP_ADDI:
+	case OP_ADDIS:
+	case OP_ANDI:
+	case OP_ANDIS:
+	case OP_EORI:
+	case OP_ORRI:
+	case OP_SUBI:
+	case OP_SUBIS:
+	case OP_LSL:
+	case OP_LSR:
+	case OP_LDUR:
+	case OP_LDURB:
+	case OP_LDURH:
+	case OP_LDURSW:
+		*use = Rn;
+		*def = Rd;
+		break;
+	case OP_STUR:
+	case OP_STURB:
+	case OP_STURH:
+	case OP_STURSW:
+		*use = Rn | Rd;
+		break;
+	case OP_LDURS:
+	case OP_LDURD:
+	case OP_STURS:
+	case OP_STURD:
+		// Rt is an FP register, only the base is an X register
+		*use = Rn;
+		break;
+	case OP_CBZ:
+	case OP_CBNZ:
+	case OP_PRNT:
+		*use = Rd;
+		break;
+	case OP_BR:
+		*use = Rn;
+		break;
+	case OP_BL:
+		*def = 1u << 30;
+		break;
+	case OP_DUMP:
+	case OP_HALT:
+		// both print every register
+		*use = 0xFFFFFFFF;
+		break;
+	}
+	*use &= 0x7FFFFFFF;
+	*def &= 0x7FFFFFFF;
+}
+
+// backwards liveness over the CFG with a worklist of blocks,
+// then one more pass over each block to find writes nobody reads
+// returns: 1 if anything was reported, 0 otherwise
+int liveness_report() {
+	uint32_t *block_use = calloc(num_blocks + 1, sizeof(uint32_t));
+	uint32_t *block_def = calloc(num_blocks + 1, sizeof(uint32_t));
+	uint32_t *live_in = calloc(num_blocks + 1, sizeof(uint32_t));
+	uint32_t *live_out = calloc(num_blocks + 1, sizeof(uint32_t));
+	int *worklist = malloc((num_blocks + 1) * sizeof(int));
+	char *queued = malloc(num_blocks + 1);
+	uint32_t all_use = 0;
+	uint32_t all_def = 0;
+
+	for (int b = 0; b < num_blocks; b++) {
+		for (int i = block_start[b + 1] - 1; i >= block_start[b]; i--) {
+			uint32_t use, def;
+			reg_use_def(i, &use, &def);
+			block_use[b] = (block_use[b] & ~def) | use;
+			block_def[b] |= def;
+			all_def |= def;
+			// DUMP and HALT print every register, which would count
+			// any register as read in every program that halts
+			if (op_ids[i] != OP_DUMP && op_ids[i] != OP_HALT) {
+				all_use |= use;
+			}
+		}
+	}
+
+	// start from the last block so most facts settle in one sweep:
+	// the worklist is a stack, so push blocks in ascending order
+	int count = 0;
+	for (int b = 0; b < num_blocks; b++) {
+		worklist[count++] = b;
+		queued[b] = 1;
+	}
+	while (count > 0) {
+		int b = worklist[--count];
+		queued[b] = 0;
+
+		uint32_t out = 0;
+		// BR goes somewhere we can't see, assume it reads everything
+		if (op_ids[block_start[b + 1] - 1] == OP_BR) {
+			out = 0x7FFFFFFF;
+		}
+		for (int e = succ_offset[b]; e < succ_offset[b + 1]; e++) {
+			out |= live_in[succ[e]];
+		}
+		live_out[b] = out;
+
+		uint32_t in = block_use[b] | (out & ~block_def[b]);
+		if (in != live_in[b]) {
+			live_in[b] = in;
+			for (int e = pred_offset[b]; e < pred_offset[b + 1]; e++) {
+				if (!queued[pred[e]]) {
+					worklist[count++] = pred[e];
+					queued[pred[e]] = 1;
+				}
+			}
+		}
+	}
+
+	// walk blocks backwards to mark dead writes, report them in order
+	int reported = 0;
+	char *dead = calloc(num_words + 1, 1);
+	for (int b = 0; b < num_blocks; b++) {
+		uint32_t live = live_out[b];
+		for (int i = block_start[b + 1] - 1; i >= block_start[b]; i--) {
+			uint32_t use, def;
+			reg_use_def(i, &use, &def);
+			dead[i] = (def & ~live) != 0;
+			live = (live & ~def) | use;
+		}
+	}
+	for (int i = 0; i < num_words; i++) {
+		if (dead[i]) {
+			printf("dead write: %d: %s\n", i, instruction_list[i]);
+			reported = 1;
+		}
+	}
+	free(dead);
+
+	uint32_t never_read = all_def & ~all_use;
+	if (never_read != 0) {
+		printf("never read:");
+		for (int r = 0; r < 31; r++) {
+			if (never_read & (1u << r)) {
+				printf(" X%d", r);
+			}
+		}
+		printf("\n");
+		reported = 1;
+	}
+
+	free(block_use);
+	free(block_def);
+	free(live_in);
+	free(live_out);
+	free(worklist);
+	free(queued);
+	return reported;
+}
+
+// number of leading opcode bits for each instruction format
+int opcode_length(int id) {
+	switch (id) {
+	case OP_B:
+	case OP_BL:
+		return 6;
+	case OP_BCOND:
+	case OP_CBZ:
+	case OP_CBNZ:
+		return 8;
+	case OP_ADDI:
+	case OP_ADDIS:
+	case OP_ANDI:
+	case OP_ANDIS:
+	case OP_EORI:
+	case OP_ORRI:
+	case OP_SUBI:
+	case OP_SUBIS:
+		return 10;
+	}
+	return 11;
+}
+
+// fields of id's format a pattern may set, the rest would constrain
+// offset, address or unused bits instead
+// returns: FIELD_* flags
+int pattern_fields(int id) {
+	switch (opcode_length(id)) {
+	case 6:
+		// just the offset
+		return 0;
+	case 8:
+		// B.cond's condition is part of the mnemonic
+		return (id == OP_BCOND) ? 0 : FIELD_RD;
+	case 10:
+		return FIELD_RD | FIELD_RN | FIELD_IMM;
+	}
+	if (is_d_format(id)) {
+		return FIELD_RD | FIELD_RN | FIELD_IMM;
+	}
+	// R-format, less the registers the instruction leaves zero
+	uint32_t reserved = reserved_bits(id);
+	int fields = 0;
+	if ((reserved & 0x0000001F) == 0) {
+		fields |= FIELD_RD;
+	}
+	if ((reserved & 0x000003E0) == 0) {
+		fields |= FIELD_RN;
+	}
+	if ((reserved & 0x001F0000) == 0) {
+		fields |= FIELD_RM;
+	}
+	if (id == OP_LSL || id == OP_LSR) {
+		fields |= FIELD_IMM;
+	}
+	return fields;
+}
+
+// turn a pattern like "STUR rn=X1" or "B.EQ" into a mask/value pair
+// over the 32-bit word: (word & mask) == value for every match
+// fields: rd, rt, rn, rm, imm (I-format immediate, D-format address, shamt),
+// only the ones the instruction's format has
+// returns: 0 on success, 1 if the pattern can't be compiled
+int compile_pattern(char *pattern, int num_opcodes, uint32_t *mask, uint32_t *value) {
+	char buf[100];
+	strncpy(buf, pattern, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	char *token = strtok(buf, " ,");
+	if (token == NULL) {
+		printf("Empty pattern\n");
+		return 1;
+	}
+
+	// B.cond mnemonics carry the condition in the Rt field
+	int cond = -1;
+	if (strncmp(token, "B.", 2) == 0 && token[2] != '\0') {
+		for (int c = 0; c < 16; c++) {
+			if (strcmp(token + 2, b_suffix[c]) == 0) {
+				cond = c;
+			}
+		}
+		if (cond == -1) {
+			printf("Unknown condition: %s\n", token);
+			return 1;
+		}
+		token[2] = '\0';
+	}
+
+	// the ARM manual's name for STURSW
+	if (strcmp(token, "STURW") == 0) {
+		token = "STURSW";
+	}
+
+	int found = -1;
+	for (int n = 0; n < num_opcodes; n++) {
+		if (strcmp(instruction[n].mnemonic, token) == 0) {
+			found = n;
+		}
+	}
+	if (found == -1) {
+		printf("Unknown mnemonic: %s\n", token);
+		return 1;
+	}
+
+	int id = instruction[found].id;
+	int length = opcode_length(id);
+	*mask = ~0u << (32 - length);
+	*value = instruction[found].opcode << (32 - length);
+	if (cond != -1) {
+		*mask |= 0x1F;
+		*value |= cond;
+	}
+	// instructions sharing an opcode are told apart by shamt
+	if (instruction[found].shamt != -1) {
+		*mask |= 0x3F << 10;
+		*value |= instruction[found].shamt << 10;
+	}
+	// only match words the listing decodes as this instruction
+	*mask |= reserved_mask[found];
+
+	while ((token = strtok(NULL, " ,")) != NULL) {
+		char *eq = strchr(token, '=');
+		if (eq == NULL) {
+			printf("Expected field=value: %s\n", token);
+			return 1;
+		}
+		*eq = '\0';
+		char *num = eq + 1;
+		if (*num == 'X' || *num == 'x' || *num == '#') {
+			num++;
+		}
+		uint32_t v = strtoul(num, NULL, 0);
+
+		int shift, bits;
+		int fields = pattern_fields(id);
+		if ((strcmp(token, "rd") == 0 || strcmp(token, "rt") == 0) && (fields & FIELD_RD)) {
+			shift = 0;
+			bits = 5;
+		} else if (strcmp(token, "rn") == 0 && (fields & FIELD_RN)) {
+			shift = 5;
+			bits = 5;
+		} else if (strcmp(token, "rm") == 0 && (fields & FIELD_RM)) {
+			shift = 16;
+			bits = 5;
+		} else if (strcmp(token, "imm") == 0 && (fields & FIELD_IMM)) {
+			// I-format immediate, D-format address or shamt
+			if (length == 10) {
+				shift = 10;
+				bits = 12;
+			} else if (is_d_format(id)) {
+				shift = 12;
+				bits = 9;
+			} else {
+				shift = 10;
+				bits = 6;
+			}
+		} else {
+			printf("Unknown field for %s: %s\n", instruction[found].mnemonic, token);
+			return 1;
+		}
+		uint32_t field = (1u << bits) - 1;
+		*mask |= field << shift;
+		*value = (*value & ~(field << shift)) | ((v & field) << shift);
+	}
+	return 0;
+}
+
+// compare every raw word against the pattern without byte swapping:
+// the pattern is swapped to the input's byte order once instead
+void find_pattern(uint32_t *program, long count, uint32_t mask, uint32_t value, int num_opcodes) {
+	uint32_t be_mask = (input_little_endian == 1) ? htole32(mask) : htobe32(mask);
+	uint32_t be_value = (input_little_endian == 1) ? htole32(value) : htobe32(value);
+	long i = 0;
+
+#ifdef __SSE2__
+	// 16 words per step, one bit per word in hits
+	__m128i vmask = _mm_set1_epi32(be_mask);
+	__m128i vvalue = _mm_set1_epi32(be_value);
+	for (; i + 16 <= count; i += 16) {
+		int hits = 0;
+		for (int j = 0; j < 4; j++) {
+			__m128i x = _mm_loadu_si128((__m128i *)(program + i + 4 * j));
+			__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(x, vmask), vvalue);
+			hits |= _mm_movemask_ps(_mm_castsi128_ps(eq)) << (4 * j);
+		}
+		while (hits != 0) {
+			print_match(program, i + __builtin_ctz(hits), num_opcodes);
+			hits &= hits - 1;
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		if ((program[i] & be_mask) == be_value) {
+			print_match(program, i, num_opcodes);
+		}
+	}
+}
+
+// decode a single matching word at its own index and print it.
+// only matches are decoded, so there are no labels: branches get
+// their absolute target index instead, even outside the image
+void print_match(uint32_t *program, long i, int num_opcodes) {
+	intfloat t;
+	t.i = (input_little_endian == 1) ? le32toh(program[i]) : be32toh(program[i]);
+
+	int idx = find_opcode(t.i);
+	int id = (idx > -1) ? instruction[idx].id : OP_INVALID;
+
+	char str[64];
+	format_instruction(t, i, str);
+	printf("%ld: %s", i, str);
+	if (id == OP_B || id == OP_BL || id == OP_BCOND || id == OP_CBZ || id == OP_CBNZ) {
+		printf(" -> %ld", i + branch_offset(t.i, id));
+	}
+	printf("\n");
+}
+
+// hand a batch to the next stage, waiting while its ring is full
+void ring_push(spsc_ring *ring, pipe_batch *batch) {
+	unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == PIPE_RING) {
+		sched_yield();
+	}
+	ring->slots[tail % PIPE_RING] = batch;
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// take the next batch from the previous stage, waiting while there is none
+pipe_batch *ring_pop(spsc_ring *ring) {
+	unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+		sched_yield();
+	}
+	pipe_batch *batch = ring->slots[head % PIPE_RING];
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return batch;
+}
+
+// copy words out of the mapping (faulting pages in) in file order,
+// an empty batch marks the end for every later stage
+void *pipe_reader(void *arg) {
+	pipeline *p = arg;
+	int start = 0;
+
+	while (1) {
+		pipe_batch *batch = ring_pop(&p->free_batches);
+		batch->start = start;
+		batch->count = p->count - start;
+		if (batch->count > PIPE_BATCH) {
+			batch->count = PIPE_BATCH;
+		}
+		BY_INPUT_ORDER(
+		for (int j = 0; j < batch->count; j++) {
+			batch->words[j] = LOAD_WORD(p->program[start + j]);
+		}
+		)
+		start += batch->count;
+		ring_push(&p->to_decode, batch);
+		if (batch->count == 0) {
+			return NULL;
+		}
+	}
+}
+
+// look up the instruction of every word
+void *pipe_decoder(void *arg) {
+	pipeline *p = arg;
+
+	while (1) {
+		pipe_batch *batch = ring_pop(&p->to_decode);
+		for (int j = 0; j < batch->count; j++) {
+			batch->found[j] = find_opcode(batch->words[j]);
+		}
+		ring_push(&p->to_format, batch);
+		if (batch->count == 0) {
+			return NULL;
+		}
+	}
+}
+
+// produce the text of a batch, label lines included
+void *pipe_formatter(void *arg) {
+	pipeline *p = arg;
+
+	while (1) {
+		pipe_batch *batch = ring_pop(&p->to_format);
+		char *text = batch->text;
+		for (int j = 0; j < batch->count; j++) {
+			text += format_line(batch->words[j], batch->found[j], batch->start + j, NULL, text);
+		}
+		batch->length = text - batch->text;
+		ring_push(&p->to_write, batch);
+		if (batch->count == 0) {
+			memo_release();
+			return NULL;
+		}
+	}
+}
+
+// write finished text in order and recycle the batch
+void *pipe_writer(void *arg) {
+	pipeline *p = arg;
+
+	while (1) {
+		pipe_batch *batch = ring_pop(&p->to_write);
+		fwrite(batch->text, 1, batch->length, stdout);
+		if (batch->count == 0) {
+			fflush(stdout);
+			return NULL;
+		}
+		ring_push(&p->free_batches, batch);
+	}
+}
+
+// print the listing with every stage on its own thread.
+// labels must already be numbered by scan_branches
+void run_pipeline(uint32_t *program, int count) {
+	pipeline *p = calloc(1, sizeof(pipeline));
+	pipe_batch *pool = malloc(PIPE_RING * sizeof(pipe_batch));
+	p->program = program;
+	p->count = count;
+	for (int b = 0; b < PIPE_RING; b++) {
+		ring_push(&p->free_batches, &pool[b]);
+	}
+
+	pthread_t ids[4];
+	pthread_create(&ids[0], NULL, pipe_reader, p);
+	pthread_create(&ids[1], NULL, pipe_decoder, p);
+	pthread_create(&ids[2], NULL, pipe_formatter, p);
+	pthread_create(&ids[3], NULL, pipe_writer, p);
+	for (int t = 0; t < 4; t++) {
+		pthread_join(ids[t], NULL);
+	}
+
+	free(pool);
+	free(p);
+}
+
+// count the bytes of text for a chunk without keeping any of it
+void *measure_chunk(void *arg) {
+	output_chunk *chunk = arg;
+	char line[2 * PIPE_LINE + 20];
+
+	chunk->length = 0;
+	BY_INPUT_ORDER(
+	for (int i = chunk->start; i < chunk->end; i++) {
+		uint32_t w = LOAD_WORD(chunk->program[i]);
+		int length = format_line(w, find_opcode(w), i, NULL, line);
+		chunk->length += length;
+		if (chunk->page_lengths != NULL) {
+			chunk->page_lengths[i / (WATCH_PAGE / 4)] += length;
+		}
+	}
+	)
+	memo_release();
+	return NULL;
+}
+
+// format a chunk into its slice of the output mapping. lines go through
+// a local buffer so no NUL lands in the next chunk's slice
+void *write_chunk(void *arg) {
+	output_chunk *chunk = arg;
+	char line[2 * PIPE_LINE + 20];
+	char *out = chunk->out;
+
+	BY_INPUT_ORDER(
+	for (int i = chunk->start; i < chunk->end; i++) {
+		uint32_t w = LOAD_WORD(chunk->program[i]);
+		int length = format_line(w, find_opcode(w), i, NULL, line);
+		memcpy(out, line, length);
+		out += length;
+	}
+	)
+	memo_release();
+	return NULL;
+}
+
+// write the listing to path using one thread per cpu: measure every chunk,
+// prefix sum the lengths into file offsets, size the file once, then
+// let all threads format into the mapped file at the same time
+// page_lengths: if not NULL, gets the bytes of text of every WATCH_PAGE
+// of input added to it
+// returns: 0 on success, 1 on error
+int write_listing(uint32_t *program, int count, char *path, long *page_lengths) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) {
+		threads = 1;
+	}
+	if (threads > count / 65536 + 1) {
+		threads = count / 65536 + 1;
+	}
+
+	output_chunk *chunks = calloc(threads, sizeof(output_chunk));
+	pthread_t *ids = malloc(threads * sizeof(pthread_t));
+	for (int t = 0; t < threads; t++) {
+		// chunks start on a page so every page length has one writer
+		chunks[t].program = program;
+		chunks[t].start = (long)count * t / threads / (WATCH_PAGE / 4) * (WATCH_PAGE / 4);
+		chunks[t].end = (t + 1 < threads) ? (long)count * (t + 1) / threads / (WATCH_PAGE / 4) * (WATCH_PAGE / 4) : count;
+		chunks[t].page_lengths = page_lengths;
+		pthread_create(&ids[t], NULL, measure_chunk, &chunks[t]);
+	}
+	for (int t = 0; t < threads; t++) {
+		pthread_join(ids[t], NULL);
+	}
+
+	long total = 0;
+	for (int t = 0; t < threads; t++) {
+		total += chunks[t].length;
+	}
+
+	int ofd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (ofd == -1) {
+		perror("Error writing output file");
+		free(chunks);
+		free(ids);
+		return 1;
+	}
+	// fall back to a sparse file where fallocate isn't supported
+	if (total > 0 && posix_fallocate(ofd, 0, total) != 0 && ftruncate(ofd, total) != 0) {
+		perror("Error sizing output file");
+		close(ofd);
+		free(chunks);
+		free(ids);
+		return 1;
+	}
+
+	if (total > 0) {
+		char *output = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+		if (output == MAP_FAILED) {
+			perror("Error mapping output file");
+			close(ofd);
+			free(chunks);
+			free(ids);
+			return 1;
+		}
+
+		long offset = 0;
+		for (int t = 0; t < threads; t++) {
+			chunks[t].out = output + offset;
+			offset += chunks[t].length;
+			pthread_create(&ids[t], NULL, write_chunk, &chunks[t]);
+		}
+		for (int t = 0; t < threads; t++) {
+			pthread_join(ids[t], NULL);
+		}
+		munmap(output, total);
+	}
+
+	close(ofd);
+	free(chunks);
+	free(ids);
+	return 0;
+}
+
+// FNV-1a over one WATCH_PAGE sized page of the input, 8 bytes at a time
+uint64_t page_hash(uint32_t *program, long size, long page) {
+	long start = page * WATCH_PAGE / 4;
+	long end = (page + 1) * WATCH_PAGE / 4;
+	if (end > size / 4) {
+		end = size / 4;
+	}
+	uint64_t hash = 14695981039346656037ull;
+	long i = start;
+	for (; i + 2 <= end; i += 2) {
+		uint64_t pair;
+		memcpy(&pair, program + i, 8);
+		hash = (hash ^ pair) * 1099511628211ull;
+	}
+	if (i < end) {
+		hash = (hash ^ program[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// forget the branches among words start..end-1. targets no other branch
+// points at any more are only collected, since marking the new words
+// may point at them again
+// unreferenced: gets those targets, room for end - start
+// returns: number of targets in unreferenced
+int unmark_branches(int start, int end, int *unreferenced) {
+	int count = 0;
+	for (int i = start; i < end; i++) {
+		int target = branch_target[i];
+		if (target != NO_TARGET) {
+			if (--target_refs[target] == 0) {
+				unreferenced[count++] = target;
+			}
+			branch_target[i] = NO_TARGET;
+		} else if (label_ref[i] != 0) {
+			outside_branches--;
+		}
+		label_ref[i] = 0;
+	}
+	return count;
+}
+
+// replace the text of the dirty pages in the listing at path, labels
+// must be unchanged. unchanged runs of text between dirty pages are
+// moved by what the dirty pages in front of them grew or shrank:
+// runs moving towards the start front to back, the others back to front,
+// so no run overwrites one that hasn't moved yet
+// dirty: changed pages in increasing order
+// returns: 0 on success, 1 on error
+int patch_listing(char *path, uint32_t *program, long *dirty, long num_dirty, long *page_lengths, long pages) {
+	long *old_offset = malloc((pages + 1) * sizeof(long));
+	old_offset[0] = 0;
+	for (long p = 0; p < pages; p++) {
+		old_offset[p + 1] = old_offset[p] + page_lengths[p];
+	}
+
+	// new text of every dirty page, and how far everything after it moves
+	char **texts = malloc(num_dirty * sizeof(char *));
+	long *lengths = malloc(num_dirty * sizeof(long));
+	long *shift = malloc((num_dirty + 1) * sizeof(long));
+	shift[0] = 0;
+	for (long d = 0; d < num_dirty; d++) {
+		int start = dirty[d] * (WATCH_PAGE / 4);
+		int end = (start + WATCH_PAGE / 4 < num_words) ? start + WATCH_PAGE / 4 : num_words;
+		char *out = texts[d] = malloc((WATCH_PAGE / 4) * (2 * PIPE_LINE + 20));
+		BY_INPUT_ORDER(
+		for (int i = start; i < end; i++) {
+			uint32_t w = LOAD_WORD(program[i]);
+			out += format_line(w, find_opcode(w), i, NULL, out);
+		}
+		)
+		lengths[d] = out - texts[d];
+		shift[d + 1] = shift[d] + lengths[d] - page_lengths[dirty[d]];
+	}
+	long old_total = old_offset[pages];
+	long new_total = old_total + shift[num_dirty];
+	long mapped = (new_total > old_total) ? new_total : old_total;
+
+	int ofd = open(path, O_RDWR);
+	if (ofd == -1 || (new_total > old_total && ftruncate(ofd, new_total) != 0)) {
+		perror("Error writing output file");
+		return 1;
+	}
+	char *output = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, ofd, 0);
+	if (output == MAP_FAILED) {
+		perror("Error mapping output file");
+		close(ofd);
+		return 1;
+	}
+
+	// run d is the unchanged text after dirty page d-1 up to dirty page d
+	for (long d = 0; d <= num_dirty; d++) {
+		long from = (d == 0) ? 0 : old_offset[dirty[d - 1] + 1];
+		long to = (d == num_dirty) ? old_total : old_offset[dirty[d]];
+		if (shift[d] < 0) {
+			memmove(output + from + shift[d], output + from, to - from);
+		}
+	}
+	for (long d = num_dirty; d >= 0; d--) {
+		long from = (d == 0) ? 0 : old_offset[dirty[d - 1] + 1];
+		long to = (d == num_dirty) ? old_total : old_offset[dirty[d]];
+		if (shift[d] > 0) {
+			memmove(output + from + shift[d], output + from, to - from);
+		}
+	}
+	for (long d = 0; d < num_dirty; d++) {
+		memcpy(output + old_offset[dirty[d]] + shift[d], texts[d], lengths[d]);
+		page_lengths[dirty[d]] = lengths[d];
+		free(texts[d]);
+	}
+
+	munmap(output, mapped);
+	int status = 0;
+	if (new_total < old_total && ftruncate(ofd, new_total) != 0) {
+		perror("Error sizing output file");
+		status = 1;
+	}
+	close(ofd);
+	free(old_offset);
+	free(texts);
+	free(lengths);
+	free(shift);
+	return status;
+}
+
+// write the listing to output_file, then update it every time the input
+// is written again. only pages whose hash changed have their branches
+// re-read; if no label moved, only their text is replaced in the
+// listing, otherwise labels are renumbered and the whole listing is
+// written again. a change of size starts over
+// returns: only on error, 1
+int watch_listing(char *path, char *output_file, uint32_t *program, long size, int fd) {
+	long pages = (size + WATCH_PAGE - 1) / WATCH_PAGE;
+	uint64_t *hashes = malloc((pages + 1) * sizeof(uint64_t));
+	long *page_lengths = calloc(pages + 1, sizeof(long));
+	long *dirty = malloc((pages + 1) * sizeof(long));
+	int unreferenced[WATCH_PAGE / 4];
+	int outside[WATCH_PAGE / 4];
+	for (long p = 0; p < pages; p++) {
+		hashes[p] = page_hash(program, size, p);
+	}
+	target_refs = calloc(num_words + 1, sizeof(int));
+	for (int i = 0; i < num_words; i++) {
+		if (branch_target[i] != NO_TARGET) {
+			target_refs[branch_target[i]]++;
+		}
+	}
+	if (write_listing(program, num_words, output_file, page_lengths) != 0) {
+		return 1;
+	}
+
+	// editors and assemblers often write a new file and rename it over
+	// the old one, so watch the directory for the name
+	char *dir_copy = strdup(path);
+	char *name_copy = strdup(path);
+	char *dir = dirname(dir_copy);
+	char *name = basename(name_copy);
+	int watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd == -1 || inotify_add_watch(watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+		perror("Error watching input");
+		return 1;
+	}
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		long len = read(watch_fd, events, sizeof(events));
+		if (len < 0 && errno == EINTR) {
+			continue;
+		}
+		if (len <= 0) {
+			perror("Error reading file events");
+			return 1;
+		}
+		int changed = 0;
+		for (char *e = events; e < events + len; ) {
+			struct inotify_event *event = (struct inotify_event *)e;
+			if (event->len > 0 && strcmp(event->name, name) == 0) {
+				changed = 1;
+			}
+			e += sizeof(struct inotify_event) + event->len;
+		}
+		if (!changed) {
+			continue;
+		}
+
+		struct timespec begin, done;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+
+		struct stat buf;
+		int new_fd = open(path, O_RDONLY);
+		if (new_fd == -1 || fstat(new_fd, &buf) == -1 || buf.st_size < 4) {
+			// mid-replace or emptied, the next write brings it back
+			if (new_fd != -1) {
+				close(new_fd);
+			}
+			continue;
+		}
+		long new_size = buf.st_size;
+		uint32_t *new_program = load_file(new_fd, new_size, IO_MMAP);
+		if (new_program == MAP_FAILED) {
+			close(new_fd);
+			continue;
+		}
+		munmap(program, size);
+		close(fd);
+		program = new_program;
+		fd = new_fd;
+		size = new_size;
+
+		long num_dirty = 0;
+		int status;
+		if (size / 4 != num_words) {
+			// every index moved: start over with arrays of the new size
+			for (int l = 0; l < labels_named; l++) {
+				free(branches[l].label);
+			}
+			labels_named = 0;
+			num_words = size / 4;
+			pages = (size + WATCH_PAGE - 1) / WATCH_PAGE;
+			branches = realloc(branches, (num_words + 1) * sizeof(branch_label));
+			branch_target = realloc(branch_target, (num_words + 1) * sizeof(int));
+			label_ref = realloc(label_ref, (num_words + 1) * sizeof(int));
+			hashes = realloc(hashes, (pages + 1) * sizeof(uint64_t));
+			dirty = realloc(dirty, (pages + 1) * sizeof(long));
+			free(page_lengths);
+			free(target_refs);
+			free(target_bits);
+			free(target_rank);
+			page_lengths = calloc(pages + 1, sizeof(long));
+			target_refs = calloc(num_words + 1, sizeof(int));
+			memset(label_ref, 0, (num_words + 1) * sizeof(int));
+			for (int i = 0; i <= num_words; i++) {
+				branch_target[i] = NO_TARGET;
+			}
+			outside_branches = 0;
+			scan_branches(program, num_words);
+			for (long p = 0; p < pages; p++) {
+				hashes[p] = page_hash(program, size, p);
+			}
+			num_dirty = pages;
+			status = write_listing(program, num_words, output_file, page_lengths);
+		} else {
+			labels_changed = 0;
+			for (long p = 0; p < pages; p++) {
+				uint64_t hash = page_hash(program, size, p);
+				if (hash == hashes[p]) {
+					continue;
+				}
+				hashes[p] = hash;
+				int start = p * (WATCH_PAGE / 4);
+				int end = (start + WATCH_PAGE / 4 < num_words) ? start + WATCH_PAGE / 4 : num_words;
+				// outside branches are numbered in order, so any change
+				// to where they are renumbers them. otherwise they keep
+				// the numbers they had, which marking resets
+				for (int i = start; i < end; i++) {
+					outside[i - start] = (branch_target[i] == NO_TARGET) ? label_ref[i] : 0;
+				}
+				int gone = unmark_branches(start, end, unreferenced);
+				mark_branches(program, start, end);
+				for (int t = 0; t < gone; t++) {
+					int target = unreferenced[t];
+					if (target_refs[target] == 0) {
+						target_bits[target >> 6] &= ~(1ull << (target & 63));
+						labels_changed = 1;
+					}
+				}
+				for (int i = start; i < end; i++) {
+					int now_outside = branch_target[i] == NO_TARGET && label_ref[i] != 0;
+					if ((outside[i - start] != 0) != now_outside) {
+						labels_changed = 1;
+					} else if (now_outside) {
+						label_ref[i] = outside[i - start];
+					}
+				}
+				dirty[num_dirty++] = p;
+			}
+			if (num_dirty == 0) {
+				continue;
+			}
+			if (labels_changed) {
+				number_labels(num_words);
+				memset(page_lengths, 0, pages * sizeof(long));
+				status = write_listing(program, num_words, output_file, page_lengths);
+			} else {
+				status = patch_listing(output_file, program, dirty, num_dirty, page_lengths, pages);
+			}
+		}
+		if (status != 0) {
+			return 1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		fprintf(stderr, "%s: %ld of %ld pages changed, listing %s in %.1f ms\n", path, num_dirty, pages,
+				(num_dirty == pages || labels_changed) ? "rewritten" : "patched",
+				(done.tv_sec - begin.tv_sec) * 1e3 + (done.tv_nsec - begin.tv_nsec) / 1e6);
+	}
+}
+
+// write each value as 8 lowercase hex digits, no separators: out gets
+// 8 * count characters and no NUL. SSE2 does 4 values per step
+void hex_encode(uint32_t *values, int count, char *out) {
+	static const char digits[] = "0123456789abcdef";
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i zero = _mm_set1_epi8('0');
+	__m128i letters = _mm_set1_epi8('a' - '0' - 10);
+	for (; i + 4 <= count; i += 4) {
+		// big endian bytes read most significant digit first
+		uint32_t be[4];
+		for (int j = 0; j < 4; j++) {
+			be[j] = htobe32(values[i + j]);
+		}
+		__m128i x = _mm_loadu_si128((__m128i *)be);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), nibble);
+		__m128i lo = _mm_and_si128(x, nibble);
+		__m128i first = _mm_unpacklo_epi8(hi, lo);
+		__m128i second = _mm_unpackhi_epi8(hi, lo);
+		first = _mm_add_epi8(_mm_add_epi8(first, zero), _mm_and_si128(_mm_cmpgt_epi8(first, nine), letters));
+		second = _mm_add_epi8(_mm_add_epi8(second, zero), _mm_and_si128(_mm_cmpgt_epi8(second, nine), letters));
+		_mm_storeu_si128((__m128i *)(out + 8 * i), first);
+		_mm_storeu_si128((__m128i *)(out + 8 * i + 16), second);
+	}
+#endif
+
+	for (; i < count; i++) {
+		for (int d = 0; d < 8; d++) {
+			out[8 * i + d] = digits[(values[i] >> (28 - 4 * d)) & 0xF];
+		}
+	}
+}
+
+// print the listing with the byte offset and raw word in front of every
+// instruction. both hex columns are encoded a batch at a time
+void print_annotated(uint32_t *program, int count) {
+	uint32_t *batch = malloc(PIPE_BATCH * sizeof(uint32_t));
+	uint32_t *offsets = malloc(PIPE_BATCH * sizeof(uint32_t));
+	char *hex = malloc(PIPE_BATCH * 16);
+	char *text = malloc(PIPE_BATCH * (2 * PIPE_LINE + ANNOTATE_WIDTH));
+	char columns[ANNOTATE_WIDTH];
+
+	for (int start = 0; start < count; start += PIPE_BATCH) {
+		int n = (count - start < PIPE_BATCH) ? count - start : PIPE_BATCH;
+		BY_INPUT_ORDER(
+		for (int j = 0; j < n; j++) {
+			batch[j] = LOAD_WORD(program[start + j]);
+			offsets[j] = (uint32_t)(start + j) * 4;
+		}
+		)
+		hex_encode(offsets, n, hex);
+		hex_encode(batch, n, hex + 8 * n);
+
+		char *out = text;
+		memcpy(columns + 8, ":  ", 3);
+		memcpy(columns + 19, "  ", 2);
+		for (int j = 0; j < n; j++) {
+			memcpy(columns, hex + 8 * j, 8);
+			memcpy(columns + 11, hex + 8 * (n + j), 8);
+			out += format_line(batch[j], find_opcode(batch[j]), start + j, columns, out);
+		}
+		fwrite(text, 1, out - text, stdout);
+	}
+
+	free(batch);
+	free(offsets);
+	free(hex);
+	free(text);
+}
+
+// one thread's share of the histogram
+typedef struct {
+	uint32_t *program;
+	long start;
+	long end;
+	uint64_t counts[2049];
+} histogram_part;
+
+// count instructions in [start, end), last slot is for invalid words
+void *histogram_chunk(void *arg) {
+	histogram_part *part = arg;
+	uint64_t *counts = part->counts;
+
+	BY_INPUT_ORDER(
+	for (long i = part->start; i < part->end; i++) {
+		int idx = find_opcode(LOAD_WORD(part->program[i]));
+		counts[(idx < 0) ? 2048 : idx]++;
+	}
+	)
+	return NULL;
+}
+
+// split words over one thread per cpu and add their counters to totals
+// (instruction[] entries, then one for invalid words)
+void count_histogram(uint32_t *program, long count, int num_opcodes, uint64_t *totals) {
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) {
+		threads = 1;
+	}
+	// small inputs aren't worth starting threads for
+	if (threads > count / 65536 + 1) {
+		threads = count / 65536 + 1;
+	}
+
+	histogram_part *parts = calloc(threads, sizeof(histogram_part));
+	pthread_t *ids = malloc(threads * sizeof(pthread_t));
+	for (int t = 0; t < threads; t++) {
+		parts[t].program = program;
+		parts[t].start = count * t / threads;
+		parts[t].end = count * (t + 1) / threads;
+		if (t > 0) {
+			pthread_create(&ids[t], NULL, histogram_chunk, &parts[t]);
+		}
+	}
+	histogram_chunk(&parts[0]);
+	for (int t = 1; t < threads; t++) {
+		pthread_join(ids[t], NULL);
+	}
+
+	for (int t = 0; t < threads; t++) {
+		for (int n = 0; n < num_opcodes; n++) {
+			totals[n] += parts[t].counts[n];
+		}
+		totals[num_opcodes] += parts[t].counts[2048];
+	}
+
+	free(parts);
+	free(ids);
+}
+
+// histogram of input that can't be mapped, counted one buffer at a time
+// so memory use doesn't grow with the input
+// returns: 0 on success, 1 if reading failed
+int stream_histogram(int fd, char *prefix, long prefix_len, int num_opcodes, uint64_t *totals, uint64_t *count) {
+	char *buffer = malloc(STREAM_BUFFER);
+	long have = prefix_len;
+	long n;
+
+	memcpy(buffer, prefix, prefix_len);
+	*count = 0;
+	while ((n = read_fully(fd, buffer + have, STREAM_BUFFER - have)) > 0) {
+		have += n;
+		long whole = have / 4;
+		pick_input_order((uint32_t *)buffer, whole);
+		count_histogram((uint32_t *)buffer, whole, num_opcodes, totals);
+		*count += whole;
+		// keep a partial word for the next read
+		memmove(buffer, buffer + whole * 4, have - whole * 4);
+		have -= whole * 4;
+	}
+	free(buffer);
+	return n < 0;
+}
+
+// print every mnemonic by count, most common first
+void print_histogram(uint64_t *totals, uint64_t count, int num_opcodes) {
+	int rows = num_opcodes + 1;
+	int *order = malloc(rows * sizeof(int));
+
+	// insertion sort, the table is tiny
+	for (int r = 0; r < rows; r++) {
+		int j = r - 1;
+		while (j >= 0 && totals[order[j]] < totals[r]) {
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = r;
+	}
+
+	for (int r = 0; r < rows; r++) {
+		int n = order[r];
+		if (totals[n] == 0) {
+			continue;
+		}
+		const char *name = "(invalid)";
+		if (n < num_opcodes) {
+			name = (instruction[n].id == OP_BCOND) ? "B.cond" : instruction[n].mnemonic;
+		}
+		printf("%-10s %12lu %7.2f%%\n", name, totals[n], 100.0 * totals[n] / count);
+	}
+	printf("%-10s %12lu\n", "total", count);
+
+	free(order);
+}
+
+// read until len bytes are in or the input ends
+// returns: bytes read, 0 at end of input, -1 on error
+long read_fully(int fd, char *data, long len) {
+	long done = 0;
+	while (done < len) {
+		long n = read(fd, data + done, len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			perror("Error reading input");
+			return -1;
+		}
+		if (n == 0) {
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+// read all of an unmappable input (pipe, stdin) into memory,
+// STREAM_BUFFER bytes per read into a buffer grown by doubling
+// returns: the words, with the byte count in *size, or NULL on error
+uint32_t *read_program(int fd, char *prefix, long prefix_len, long *size) {
+	long capacity = STREAM_BUFFER;
+	long used = prefix_len;
+	char *data = malloc(capacity);
+	long n;
+
+	// bytes already taken from fd to look for a compression header
+	memcpy(data, prefix, prefix_len);
+	while ((n = read_fully(fd, data + used, capacity - used < STREAM_BUFFER ? capacity - used : STREAM_BUFFER)) > 0) {
+		used += n;
+		if (used == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+	if (n < 0) {
+		free(data);
+		return NULL;
+	}
+	*size = used;
+	return (uint32_t *)data;
+}
+
+// bring a regular file of size bytes into memory with the chosen backend.
+// either way the result is a mapping, released with munmap
+// returns: the words, or MAP_FAILED if the file has to be streamed
+uint32_t *load_file(int fd, long size, int backend) {
+	void *data;
+
+	if (backend == IO_AUTO) {
+		backend = (size >= LARGE_INPUT) ? IO_POPULATE : IO_MMAP;
+	}
+
+	if (backend == IO_PREAD) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED) {
+			perror("Error allocating input buffer");
+			return MAP_FAILED;
+		}
+		if (size >= LARGE_INPUT) {
+			madvise(data, size, MADV_HUGEPAGE);
+		}
+		posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+		long done = 0;
+		while (done < size) {
+			long len = (size - done < PREAD_BUFFER) ? size - done : PREAD_BUFFER;
+			long n = pread(fd, (char *)data + done, len, done);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				perror("Error reading file");
+				munmap(data, size);
+				return MAP_FAILED;
+			}
+			done += n;
+		}
+		return data;
+	}
+
+	int flags = MAP_PRIVATE;
+	if (backend == IO_POPULATE) {
+		flags |= MAP_POPULATE;
+	}
+	data = mmap(NULL, size, PROT_READ, flags, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("Error mapping file");
+		return MAP_FAILED;
+	}
+	// every mode walks the file front to back
+	madvise(data, size, MADV_SEQUENTIAL);
+	if (backend != IO_POPULATE) {
+		madvise(data, size, MADV_WILLNEED);
+	}
+	if (size >= LARGE_INPUT) {
+		madvise(data, size, MADV_HUGEPAGE);
+	}
+	return data;
+}
+
+// decide the byte order of the input if --endian didn't: LEGv8 images
+// carry no header, so decode the first words both ways. little-endian
+// wins only if it decodes more words and most of the sample, so data
+// files that happen to hold a few valid words stay big-endian
+void pick_input_order(uint32_t *program, long count) {
+	if (input_little_endian != -1) {
+		return;
+	}
+	input_little_endian = guess_little_endian(program, count);
+}
+
+// the guess behind pick_input_order, without setting anything
+// returns: 1 if program looks little-endian, 0 otherwise
+int guess_little_endian(uint32_t *program, long count) {
+	int sample = 0;
+	int big = 0;
+	int little = 0;
+	for (long i = 0; i < count && i < 4096; i++) {
+		big += find_opcode(be32toh(program[i])) > -1;
+		little += find_opcode(le32toh(program[i])) > -1;
+		sample++;
+	}
+	return little > big && little * 2 > sample;
+}
+
+// unmap or free the input depending on how it was loaded,
+// and stop the decompressor if there is one
+void close_input(uint32_t *program, long size, int mapped, int fd) {
+	if (mapped) {
+		munmap(program, size);
+	} else {
+		free(program);
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	finish_decompress();
+}
+
+// check the magic bytes at the start of the input
+int compression_format(unsigned char *data, long len) {
+	if (len >= 2 && data[0] == 0x1F && data[1] == 0x8B) {
+		return COMPRESSED_GZIP;
+	}
+	if (len >= 4 && data[0] == 0x28 && data[1] == 0xB5 && data[2] == 0x2F && data[3] == 0xFD) {
+		return COMPRESSED_ZSTD;
+	}
+	return COMPRESSED_NONE;
+}
+
+// next piece of compressed input: the prefix read while checking the
+// magic bytes, then reads from in_fd, or the whole mapping at once
+// returns: bytes placed in buffer (or 0 at the end), -1 on error
+long next_compressed(decompress_job *job, unsigned char *buffer, long len) {
+	if (job->prefix_len > 0) {
+		memcpy(buffer, job->prefix, job->prefix_len);
+		len = job->prefix_len;
+		job->prefix_len = 0;
+		return len;
+	}
+	if (job->in != NULL) {
+		return 0;
+	}
+	return read_fully(job->in_fd, (char *)buffer, len);
+}
+
+// returns: 0 once len bytes are written, 1 on error (reader gone)
+int write_fully(int fd, unsigned char *data, long len) {
+	while (len > 0) {
+		long n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return 1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// decompressor thread: inflate the input into out_fd STREAM_BUFFER
+// bytes at a time, closing it at the end so the reader sees EOF
+void *decompress_input(void *arg) {
+	decompress_job *job = arg;
+	unsigned char *in = malloc(STREAM_BUFFER);
+	unsigned char *out = malloc(STREAM_BUFFER);
+	long n;
+
+	if (job->format == COMPRESSED_GZIP) {
+		z_stream z;
+		memset(&z, 0, sizeof(z));
+		// 15 + 32: any window size, gzip or zlib header
+		if (inflateInit2(&z, 15 + 32) != Z_OK) {
+			job->failed = 1;
+		}
+		if (job->in != NULL) {
+			z.next_in = job->in;
+			z.avail_in = job->in_size;
+		}
+		int ret = Z_OK;
+		while (!job->failed && ret != Z_STREAM_END) {
+			if (z.avail_in == 0) {
+				n = next_compressed(job, in, STREAM_BUFFER);
+				if (n <= 0) {
+					// input ended before the stream did
+					job->failed = 1;
+					break;
+				}
+				z.next_in = in;
+				z.avail_in = n;
+			}
+			z.next_out = out;
+			z.avail_out = STREAM_BUFFER;
+			ret = inflate(&z, Z_NO_FLUSH);
+			// concatenated gzip members carry on as one stream
+			if (ret == Z_STREAM_END && (z.avail_in > 0 || job->in == NULL)) {
+				long produced = STREAM_BUFFER - z.avail_out;
+				if (write_fully(job->out_fd, out, produced) != 0) {
+					job->failed = 1;
+					break;
+				}
+				if (z.avail_in == 0 && (n = next_compressed(job, in, STREAM_BUFFER)) > 0) {
+					z.next_in = in;
+					z.avail_in = n;
+				}
+				if (z.avail_in > 0) {
+					inflateReset(&z);
+					ret = Z_OK;
+				}
+				continue;
+			}
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				job->failed = 1;
+				break;
+			}
+			if (write_fully(job->out_fd, out, STREAM_BUFFER - z.avail_out) != 0) {
+				job->failed = 1;
+			}
+		}
+		inflateEnd(&z);
+	} else {
+#ifdef HAVE_ZSTD
+		ZSTD_DStream *zs = ZSTD_createDStream();
+		ZSTD_inBuffer zin = { NULL, 0, 0 };
+		if (job->in != NULL) {
+			zin.src = job->in;
+			zin.size = job->in_size;
+		}
+		// remaining: 0 once a frame is complete and fully flushed.
+		// a call that fills out may leave more output inside libzstd,
+		// so input is only read again after one that didn't
+		size_t remaining = 0;
+		int drained = 1;
+		while (!job->failed) {
+			if (zin.pos == zin.size && drained) {
+				n = next_compressed(job, in, STREAM_BUFFER);
+				if (n < 0) {
+					job->failed = 1;
+					break;
+				}
+				if (n == 0) {
+					// input ended inside a frame: truncated
+					job->failed = remaining != 0;
+					break;
+				}
+				zin.src = in;
+				zin.size = n;
+				zin.pos = 0;
+			}
+			ZSTD_outBuffer zout = { out, STREAM_BUFFER, 0 };
+			remaining = ZSTD_decompressStream(zs, &zout, &zin);
+			if (ZSTD_isError(remaining)
+					|| write_fully(job->out_fd, out, zout.pos) != 0) {
+				job->failed = 1;
+			}
+			drained = zout.pos < zout.size;
+		}
+		ZSTD_freeDStream(zs);
+#else
+		job->failed = 1;
+		printf("zstd input needs a build with HAVE_ZSTD\n");
+#endif
+	}
+
+	if (job->failed) {
+		printf("Error decompressing input\n");
+	}
+	close(job->out_fd);
+	free(in);
+	free(out);
+	return NULL;
+}
+
+// start inflating the input on a new thread
+// in: the mapped compressed file, or NULL to read it from fd
+// returns: the read end of the pipe carrying the plain words, -1 on error
+int start_decompress(int format, int fd, unsigned char *in, long in_size, unsigned char *prefix, long prefix_len) {
+	int p[2];
+	if (pipe(p) == -1) {
+		perror("Error creating pipe");
+		return -1;
+	}
+	// a reader that stops early must not kill us with SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+
+	input_job = calloc(1, sizeof(decompress_job));
+	input_job->format = format;
+	input_job->in_fd = fd;
+	input_job->in = in;
+	input_job->in_size = in_size;
+	memcpy(input_job->prefix, prefix, prefix_len);
+	input_job->prefix_len = prefix_len;
+	input_job->out_fd = p[1];
+	pthread_create(&input_job->thread, NULL, decompress_input, input_job);
+	return p[0];
+}
+
+// wait for the decompressor and release what it was reading from
+// returns: 1 if decompression failed, 0 otherwise
+int finish_decompress() {
+	if (input_job == NULL) {
+		return 0;
+	}
+	pthread_join(input_job->thread, NULL);
+	int failed = input_job->failed;
+	if (input_job->in != NULL) {
+		munmap(input_job->in, input_job->in_size);
+	}
+	if (input_job->in_fd != STDIN_FILENO) {
+		close(input_job->in_fd);
+	}
+	free(input_job);
+	input_job = NULL;
+	return failed;
+}
+
+// read, decode and split one image for diffing
+// returns: 0 on success, 1 on error
+int load_diff_image(char *path, diff_image *image) {
+	struct stat buf;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &buf) == -1) {
+		perror(path);
+		return 1;
+	}
+
+	long size = buf.st_size;
+	int mapped = 0;
+	uint32_t *program = MAP_FAILED;
+	if (S_ISREG(buf.st_mode) && size > 0) {
+		program = load_file(fd, size, IO_AUTO);
+	}
+	if (program != MAP_FAILED) {
+		mapped = 1;
+	} else {
+		program = read_program(fd, NULL, 0, &size);
+		if (program == NULL) {
+			close(fd);
+			return 1;
+		}
+	}
+
+	int count = size / 4;
+	image->count = count;
+	image->words = malloc((count + 1) * sizeof(uint32_t));
+	image->keys = malloc((count + 1) * sizeof(uint64_t));
+	image->targets = malloc((count + 1) * sizeof(int));
+	pick_input_order(program, count);
+	BY_INPUT_ORDER(
+	for (int i = 0; i < count; i++) {
+		image->words[i] = LOAD_WORD(program[i]);
+	}
+	)
+	close_input(program, size, mapped, fd);
+
+	// leaders: first instruction, branch targets, and after block ends
+	char *leader = calloc(count + 1, 1);
+	leader[0] = 1;
+	for (int i = 0; i < count; i++) {
+		uint32_t w = image->words[i];
+		int idx = find_opcode(w);
+		int id = (idx > -1) ? instruction[idx].id : OP_INVALID;
+
+		image->targets[i] = NO_TARGET;
+		image->keys[i] = w;
+		if (id == OP_B || id == OP_BL) {
+			image->targets[i] = i + branch_offset(w, id);
+			image->keys[i] = w & ~0x03FFFFFF;
+		} else if (id == OP_BCOND || id == OP_CBZ || id == OP_CBNZ) {
+			image->targets[i] = i + branch_offset(w, id);
+			image->keys[i] = w & ~(0x7FFFF << 5);
+		}
+		if (image->targets[i] != NO_TARGET && image->targets[i] >= 0 && image->targets[i] < count) {
+			leader[image->targets[i]] = 1;
+		}
+		if (id == OP_B || id == OP_BL || id == OP_BCOND || id == OP_CBZ || id == OP_CBNZ
+				|| id == OP_BR || id == OP_HALT) {
+			leader[i + 1] = 1;
+		}
+	}
+
+	image->num_blocks = 0;
+	for (int i = 0; i < count; i++) {
+		image->num_blocks += leader[i];
+	}
+	image->block_start = malloc((image->num_blocks + 1) * sizeof(int));
+	image->block_hash = malloc((image->num_blocks + 1) * sizeof(uint64_t));
+	int b = -1;
+	for (int i = 0; i < count; i++) {
+		if (leader[i]) {
+			b++;
+			image->block_start[b] = i;
+			image->block_hash[b] = 14695981039346656037ull;
+		}
+		// FNV-1a over the keys of the block
+		image->block_hash[b] ^= image->keys[i];
+		image->block_hash[b] *= 1099511628211ull;
+	}
+	image->block_start[image->num_blocks] = count;
+	free(leader);
+	return 0;
+}
+
+// shortest edit script turning a[0..n) into b[0..m)
+// returns: number of edits written to *script, in order
+int diff_keys(uint64_t *a, int n, uint64_t *b, int m, edit_t **script) {
+	int max_d = (n + m < DIFF_MAX_D) ? n + m : DIFF_MAX_D;
+	int offset = max_d + 1;
+	int *v = malloc((2 * max_d + 3) * sizeof(int));
+	int **trace = malloc((max_d + 1) * sizeof(int *));
+	int found = -1;
+	int d;
+
+	*script = malloc((n + m + 1) * sizeof(edit_t));
+	v[offset + 1] = 0;
+	for (d = 0; d <= max_d && found == -1; d++) {
+		for (int k = -d; k <= d; k += 2) {
+			int x;
+			if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) {
+				x = v[offset + k + 1];
+			} else {
+				x = v[offset + k - 1] + 1;
+			}
+			int y = x - k;
+			while (x < n && y < m && a[x] == b[y]) {
+				x++;
+				y++;
+			}
+			v[offset + k] = x;
+			if (x >= n && y >= m) {
+				found = d;
+				break;
+			}
+		}
+		// keep v[-d..d] of every round to walk the path back
+		trace[d] = malloc((2 * d + 1) * sizeof(int));
+		memcpy(trace[d], v + offset - d, (2 * d + 1) * sizeof(int));
+	}
+	// rows in trace, d is reused by the walk back
+	int rounds = d;
+
+	int count = 0;
+	if (found == -1) {
+		// too different: everything in a replaced by everything in b
+		for (int x = 0; x < n; x++) {
+			(*script)[count++] = (edit_t){ EDIT_DELETE, x, 0 };
+		}
+		for (int y = 0; y < m; y++) {
+			(*script)[count++] = (edit_t){ EDIT_INSERT, n, y };
+		}
+	} else {
+		// walk back from (n, m), edits come out in reverse
+		int x = n;
+		int y = m;
+		for (d = found; d > 0; d--) {
+			int *prev = trace[d - 1] + (d - 1);
+			int k = x - y;
+			int prev_k;
+			if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) {
+				prev_k = k + 1;
+			} else {
+				prev_k = k - 1;
+			}
+			int prev_x = prev[prev_k];
+			int prev_y = prev_x - prev_k;
+			while (x > prev_x && y > prev_y) {
+				x--;
+				y--;
+				(*script)[count++] = (edit_t){ EDIT_EQUAL, x, y };
+			}
+			if (x == prev_x) {
+				(*script)[count++] = (edit_t){ EDIT_INSERT, x, y - 1 };
+			} else {
+				(*script)[count++] = (edit_t){ EDIT_DELETE, x - 1, y };
+			}
+			x = prev_x;
+			y = prev_y;
+		}
+		while (x > 0 && y > 0) {
+			x--;
+			y--;
+			(*script)[count++] = (edit_t){ EDIT_EQUAL, x, y };
+		}
+		for (int e = 0; e < count / 2; e++) {
+			edit_t temp = (*script)[e];
+			(*script)[e] = (*script)[count - 1 - e];
+			(*script)[count - 1 - e] = temp;
+		}
+	}
+
+	for (int t = 0; t < rounds; t++) {
+		free(trace[t]);
+	}
+	free(trace);
+	free(v);
+	return count;
+}
+
+// one run of edits between two equal instructions, starting at edit e
+// deletes, inserts: first index and length of each side of the run
+// returns: the edit after the run
+int edit_run(edit_t *script, int count, int e, int *deletes, int *inserts) {
+	deletes[0] = -1;
+	deletes[1] = 0;
+	inserts[0] = -1;
+	inserts[1] = 0;
+	for (; e < count && script[e].op != EDIT_EQUAL; e++) {
+		if (script[e].op == EDIT_DELETE) {
+			if (deletes[0] == -1) {
+				deletes[0] = script[e].a;
+			}
+			deletes[1]++;
+		} else {
+			if (inserts[0] == -1) {
+				inserts[0] = script[e].b;
+			}
+			inserts[1]++;
+		}
+	}
+	return e;
+}
+
+// print an edit script over whole images: deletes followed by inserts
+// pair up as modified instructions, the rest are plain inserts/deletes.
+// matched branches whose targets did not match each other are modified
+// too. labels are named after the index they point at in their own
+// image, so those also get both targets as new image indexes
+// totals: inserted, deleted and modified counts
+void print_diff(diff_image *a, diff_image *b, edit_t *script, int count, int *totals) {
+	int *match = malloc((a->count + 1) * sizeof(int));
+	char old_text[64];
+	char new_text[64];
+	intfloat t;
+
+	for (int i = 0; i < a->count; i++) {
+		match[i] = -1;
+	}
+	// modified instructions count as matched, so a branch to one
+	// is not reported as retargeted
+	for (int e = 0; e < count; ) {
+		if (script[e].op == EDIT_EQUAL) {
+			match[script[e].a] = script[e].b;
+			e++;
+			continue;
+		}
+		int deletes[2];
+		int inserts[2];
+		e = edit_run(script, count, e, deletes, inserts);
+		for (int j = 0; j < deletes[1] && j < inserts[1]; j++) {
+			match[deletes[0] + j] = inserts[0] + j;
+		}
+	}
+
+	int e = 0;
+	while (e < count) {
+		if (script[e].op == EDIT_EQUAL) {
+			int i = script[e].a;
+			int k = script[e].b;
+			int target = a->targets[i];
+			if (target != NO_TARGET) {
+				int moved = (target >= 0 && target < a->count) ? match[target] : target - i + k;
+				if (moved != b->targets[k]) {
+					t.i = a->words[i];
+					label_ref = a->targets;
+					format_instruction(t, i, old_text);
+					t.i = b->words[k];
+					label_ref = b->targets;
+					format_instruction(t, k, new_text);
+					char was[16] = "deleted";
+					if (moved != -1) {
+						snprintf(was, sizeof(was), "%d", moved);
+					}
+					printf("~ %d %d: %s => %s (target in new: %s => %d)\n", i, k, old_text, new_text, was, b->targets[k]);
+					totals[2]++;
+				}
+			}
+			e++;
+			continue;
+		}
+
+		int deletes[2];
+		int inserts[2];
+		e = edit_run(script, count, e, deletes, inserts);
+
+		for (int j = 0; j < deletes[1] || j < inserts[1]; j++) {
+			int i = deletes[0] + j;
+			int k = inserts[0] + j;
+			if (j < deletes[1]) {
+				t.i = a->words[i];
+				label_ref = a->targets;
+				format_instruction(t, i, old_text);
+			}
+			if (j < inserts[1]) {
+				t.i = b->words[k];
+				label_ref = b->targets;
+				format_instruction(t, k, new_text);
+			}
+			if (j < deletes[1] && j < inserts[1]) {
+				printf("~ %d %d: %s => %s\n", i, k, old_text, new_text);
+				totals[2]++;
+			} else if (j < deletes[1]) {
+				printf("- %d: %s\n", i, old_text);
+				totals[1]++;
+			} else {
+				printf("+ %d: %s\n", k, new_text);
+				totals[0]++;
+			}
+		}
+	}
+	label_ref = NULL;
+	free(match);
+}
+
+// compare two images. basic blocks are matched by hash first, so only
+// blocks that were added, removed or changed get an instruction diff
+// returns: 0 if the images match, 1 if they differ, 2 on error
+int diff_images(char *path_a, char *path_b) {
+	diff_image a, b;
+	int order = input_little_endian;
+
+	if (load_diff_image(path_a, &a) != 0) {
+		return 2;
+	}
+	input_little_endian = order;
+	if (load_diff_image(path_b, &b) != 0) {
+		return 2;
+	}
+
+	edit_t *blocks;
+	int num_edits = diff_keys(a.block_hash, a.num_blocks, b.block_hash, b.num_blocks, &blocks);
+	edit_t *script = malloc((a.count + b.count + 1) * sizeof(edit_t));
+	int count = 0;
+	int e = 0;
+
+	// expand to instructions: matched blocks match instruction by
+	// instruction, runs of unmatched blocks are diffed as one region
+	while (e < num_edits) {
+		if (blocks[e].op == EDIT_EQUAL) {
+			int i = a.block_start[blocks[e].a];
+			int k = b.block_start[blocks[e].b];
+			for (; i < a.block_start[blocks[e].a + 1]; i++, k++) {
+				script[count++] = (edit_t){ EDIT_EQUAL, i, k };
+			}
+			e++;
+			continue;
+		}
+		int a_start = a.block_start[blocks[e].a];
+		int b_start = b.block_start[blocks[e].b];
+		int a_end = a_start;
+		int b_end = b_start;
+		for (; e < num_edits && blocks[e].op != EDIT_EQUAL; e++) {
+			if (blocks[e].op == EDIT_DELETE) {
+				a_end = a.block_start[blocks[e].a + 1];
+			} else {
+				b_end = b.block_start[blocks[e].b + 1];
+			}
+		}
+
+		edit_t *region;
+		int n = diff_keys(a.keys + a_start, a_end - a_start, b.keys + b_start, b_end - b_start, &region);
+		for (int r = 0; r < n; r++) {
+			script[count++] = (edit_t){ region[r].op, a_start + region[r].a, b_start + region[r].b };
+		}
+		free(region);
+	}
+
+	int totals[3] = { 0, 0, 0 };
+	printf("--- %s\n+++ %s\n", path_a, path_b);
+	print_diff(&a, &b, script, count, totals);
+	printf("%d inserted, %d deleted, %d modified\n", totals[0], totals[1], totals[2]);
+
+	free(blocks);
+	free(script);
+	return (totals[0] + totals[1] + totals[2]) != 0;
+}
+
+int partition(int first, int last) {
+	instruction_t p = instruction[last];
+	uint32_t pivot = p.opcode;
+	int i = first - 1;
+
+	for (int j = first; j < last; j++) {
+		if (instruction[j].opcode < pivot) {
+			i++;
+			instruction_t temp = instruction[i];
+			instruction[i] = instruction[j];
+			instruction[j] = temp;
+		}
+	}
+	instruction_t temp = instruction[i + 1];
+	instruction[i + 1] = p; // insert pivot into sorted location
+	instruction[last] = temp;
+	return i+1; // location of sorted location of p
+}
+
+void quick_sort(int first, int last) {
+	if (first < last) {
+		int p = partition(first, last);
+
+		quick_sort(first, p - 1);
+		quick_sort(p + 1, last);
+	}	
+}
+
+// print the entire 32-bit instruction
+void float_bits(intfloat i) {
+	int j;
+	for (j = 31; j >= 0; j--) {
+		printf("%d", (i.i >> j) & 0x1);
+	}
+	printf("\n");
+}
+
+// print the first 11 bits opcode
+// input: 32-bit instruction
+void get_format(intfloat i) {
+	int j;
+	printf("First 11 bits: ");
+	for (j = 31; j >= 21; j--) {
+		printf("%d", (i.i >> j) & 0x1);
+	}
+	printf("\n");
+}
+
+// set up registers and memory: everything zeroed, SP and FP pointing at
+// the top of the one flat memory. unlike legv8emul, which keeps a
+// separate 512 byte stack with SP and FP starting at 512, the stack is
+// the top STACK_SIZE bytes of memory
+void init_machine(machine_t *m) {
+	memset(m, 0, sizeof(machine_t));
+	m->memory_size = MEMORY_SIZE;
+	m->memory = calloc(m->memory_size, 1);
+	m->X[28] = m->memory_size;
+	m->X[29] = m->memory_size;
+	m->words = words;
+	m->op_ids = op_ids;
+	m->num_words = num_words;
+	m->out = stdout;
+	m->err = stderr;
+}
+
+// bytes moved by a load or store
+int access_size(int id) {
+	switch (id) {
+	case OP_LDURB:
+	case OP_STURB:
+		return 1;
+	case OP_LDURH:
+	case OP_STURH:
+		return 2;
+	case OP_LDURSW:
+	case OP_STURSW:
+	case OP_LDURS:
+	case OP_STURS:
+		return 4;
+	}
+	return 8;
+}
+
+// execute m->words[] starting at m->pc until HALT or the end of the program
+// counts: one counter per instruction for profiling, or NULL
+// returns: 0 on success, 1 on a runtime error
+int run_program(machine_t *m, uint64_t *counts) {
+	int64_t *X = m->X;
+	uint32_t *words = m->words;
+	uint8_t *op_ids = m->op_ids;
+
+	while (m->pc >= 0 && m->pc < m->num_words) {
+		if (m->limit != 0 && m->executed >= m->limit) {
+			break;
+		}
+		int pc = m->pc;
+		uint32_t w = words[pc];
+
+		if (counts != NULL) {
+			counts[pc]++;
+		}
+		m->executed++;
+		m->pc = pc + 1;
+
+		// register fields, same positions as r_format/i_format/d_format
+		int Rd = w & 0x1F;
+		int Rn = (w >> 5) & 0x1F;
+		int Rm = (w >> 16) & 0x1F;
+		int shamt = (w >> 10) & 0x3F;
+		int64_t imm = (w >> 10) & 0xFFF;
+		int64_t a = X[Rn];
+		int64_t b = X[Rm];
+		int64_t result;
+
+		// sign extended branch and memory offsets
+		int32_t br_address = w & 0x03FFFFFF;
+		if (br_address & 0x02000000) {
+			br_address |= ~0x03FFFFFF;
+		}
+		int32_t cond_br_address = (w >> 5) & 0x7FFFF;
+		if (cond_br_address & 0x40000) {
+			cond_br_address |= ~0x7FFFF;
+		}
+		int64_t dt_address = (w >> 12) & 0x1FF;
+		if (dt_address & 0x100) {
+			dt_address |= ~0x1FF;
+		}
+
+		switch (op_ids[pc]) {
+		case OP_ADD:   X[Rd] = a + b; break;
+		case OP_ADDI:  X[Rd] = a + imm; break;
+		case OP_AND:   X[Rd] = a & b; break;
+		case OP_ANDI:  X[Rd] = a & imm; break;
+		case OP_EOR:   X[Rd] = a ^ b; break;
+		case OP_EORI:  X[Rd] = a ^ imm; break;
+		case OP_ORR:   X[Rd] = a | b; break;
+		case OP_ORRI:  X[Rd] = a | imm; break;
+		case OP_SUB:   X[Rd] = a - b; break;
+		case OP_SUBI:  X[Rd] = a - imm; break;
+		case OP_MUL:   X[Rd] = a * b; break;
+		case OP_SMULH: X[Rd] = ((__int128)a * b) >> 64; break;
+		case OP_UMULH: X[Rd] = ((unsigned __int128)(uint64_t)a * (uint64_t)b) >> 64; break;
+		// dividing by zero gives zero, as on ARMv8
+		case OP_SDIV:  X[Rd] = (b == 0) ? 0 : (b == -1) ? -(uint64_t)a : a / b; break;
+		case OP_UDIV:  X[Rd] = (b == 0) ? 0 : (uint64_t)a / (uint64_t)b; break;
+		case OP_LSL:   X[Rd] = (uint64_t)a << shamt; break;
+		case OP_LSR:   X[Rd] = (uint64_t)a >> shamt; break;
+		case OP_SUBS:
+		case OP_SUBIS:
+			if (op_ids[pc] == OP_SUBIS) {
+				b = imm;
+			}
+			result = (uint64_t)a - (uint64_t)b;
+			m->N = result < 0;
+			m->Z = result == 0;
+			m->C = (uint64_t)a >= (uint64_t)b;
+			m->V = ((a ^ b) & (a ^ result)) < 0;
+			X[Rd] = result;
+			break;
+		case OP_ADDS:
+		case OP_ADDIS:
+			if (op_ids[pc] == OP_ADDIS) {
+				b = imm;
+			}
+			result = (uint64_t)a + (uint64_t)b;
+			m->N = result < 0;
+			m->Z = result == 0;
+			m->C = (uint64_t)result < (uint64_t)a;
+			m->V = (~(a ^ b) & (a ^ result)) < 0;
+			X[Rd] = result;
+			break;
+		case OP_ANDS:
+		case OP_ANDIS:
+			result = a & ((op_ids[pc] == OP_ANDIS) ? imm : b);
+			m->N = result < 0;
+			m->Z = result == 0;
+			m->C = 0;
+			m->V = 0;
+			X[Rd] = result;
+			break;
+		case OP_B:
+			m->pc = pc + br_address;
+			break;
+		case OP_BL:
+			X[30] = (int64_t)(pc + 1) * 4;
+			m->pc = pc + br_address;
+			break;
+		case OP_BR:
+			m->pc = a / 4;
+			break;
+		case OP_CBZ:
+			if (X[Rd] == 0) {
+				m->pc = pc + cond_br_address;
+			}
+			break;
+		case OP_CBNZ:
+			if (X[Rd] != 0) {
+				m->pc = pc + cond_br_address;
+			}
+			break;
+		case OP_BCOND: {
+			int taken;
+			switch (Rd) {
+			case 0x0: taken = m->Z; break;
+			case 0x1: taken = !m->Z; break;
+			case 0x2: taken = m->C; break;
+			case 0x3: taken = !m->C; break;
+			case 0x4: taken = m->N; break;
+			case 0x5: taken = !m->N; break;
+			case 0x6: taken = m->V; break;
+			case 0x7: taken = !m->V; break;
+			case 0x8: taken = m->C && !m->Z; break;
+			case 0x9: taken = !(m->C && !m->Z); break;
+			case 0xA: taken = m->N == m->V; break;
+			case 0xB: taken = m->N != m->V; break;
+			case 0xC: taken = !m->Z && m->N == m->V; break;
+			case 0xD: taken = !(!m->Z && m->N == m->V); break;
+			default:  taken = 1; break;
+			}
+			if (taken) {
+				m->pc = pc + cond_br_address;
+			}
+			break;
+		}
+		case OP_FADDS:
+		case OP_FSUBS:
+		case OP_FMULS:
+		case OP_FDIVS:
+			m->D[Rd] = fp_single_op(op_ids[pc], m->D[Rn], m->D[Rm]);
+			break;
+		case OP_FADDD:
+		case OP_FSUBD:
+		case OP_FMULD:
+		case OP_FDIVD:
+			m->D[Rd] = fp_double_op(op_ids[pc], m->D[Rn], m->D[Rm]);
+			break;
+		case OP_FCMPS: {
+			intfloat x, y;
+			x.i = m->D[Rn];
+			y.i = m->D[Rm];
+			fp_compare(m, x.f, y.f);
+			break;
+		}
+		case OP_FCMPD: {
+			intdouble x, y;
+			x.i = m->D[Rn];
+			y.i = m->D[Rm];
+			fp_compare(m, x.f, y.f);
+			break;
+		}
+		case OP_LDUR:
+		case OP_LDURB:
+		case OP_LDURH:
+		case OP_LDURSW:
+		case OP_LDURS:
+		case OP_LDURD:
+		case OP_STUR:
+		case OP_STURB:
+		case OP_STURH:
+		case OP_STURSW:
+		case OP_STURS:
+		case OP_STURD: {
+			int size = access_size(op_ids[pc]);
+			int64_t address = a + dt_address;
+			if (address < 0 || address + size > m->memory_size) {
+				fprintf(m->err, "Memory access out of bounds at instruction %d: %ld\n", pc, address);
+				return 1;
+			}
+			// memory is big-endian like legv8emul's. narrow loads zero
+			// extend, except LDURSW which sign extends
+			uint8_t *bytes = m->memory + address;
+			uint64_t value = 0;
+			switch (op_ids[pc]) {
+			case OP_LDUR:
+			case OP_LDURB:
+			case OP_LDURH:
+			case OP_LDURSW:
+			case OP_LDURS:
+			case OP_LDURD:
+				for (int j = 0; j < size; j++) {
+					value = (value << 8) | bytes[j];
+				}
+				if (op_ids[pc] == OP_LDURSW) {
+					X[Rd] = (int32_t)value;
+				} else if (op_ids[pc] == OP_LDURS || op_ids[pc] == OP_LDURD) {
+					// a single load clears the upper half of the D register
+					m->D[Rd] = value;
+				} else {
+					X[Rd] = value;
+				}
+				break;
+			default:
+				value = (op_ids[pc] == OP_STURS || op_ids[pc] == OP_STURD) ? m->D[Rd] : (uint64_t)X[Rd];
+				for (int j = size - 1; j >= 0; j--) {
+					bytes[j] = value;
+					value >>= 8;
+				}
+				break;
+			}
+			break;
+		}
+		case OP_PRNT:
+			fprintf(m->out, "X%d: 0x%016lx (%ld)\n", Rd, X[Rd], X[Rd]);
+			break;
+		case OP_PRNL:
+			fprintf(m->out, "\n");
+			break;
+		case OP_DUMP:
+			dump_machine(m);
+			break;
+		case OP_HALT:
+			dump_machine(m);
+			m->pc = -1;
+			break;
+		default:
+			fprintf(m->err, "Cannot execute instruction %d: %08x\n", pc, w);
+			return 1;
+		}
+
+		// XZR always reads as zero
+		X[31] = 0;
+
+		if (m->trace != NULL) {
+			trace_step(m, pc, a + dt_address);
+		}
+	}
+	return 0;
+}
+
+// ARMv8 NaN rules, which the host's may not follow: a signalling NaN
+// operand wins over a quiet one and n over m, returned quieted, and an
+// invalid operation gives the default NaN (positive, no payload).
+// anything else is the host's IEEE result, same rounding as ARMv8
+// returns: bits of n op m, in the low half for singles
+uint64_t fp_single_op(int id, uint64_t n_bits, uint64_t m_bits) {
+	intfloat n, m, r;
+	n.i = n_bits;
+	m.i = m_bits;
+	int n_nan = (n.i & 0x7FFFFFFF) > 0x7F800000;
+	int m_nan = (m.i & 0x7FFFFFFF) > 0x7F800000;
+	if (n_nan && !(n.i & 0x00400000)) {
+		return n.i | 0x00400000;
+	}
+	if (m_nan && !(m.i & 0x00400000)) {
+		return m.i | 0x00400000;
+	}
+	if (n_nan || m_nan) {
+		return n_nan ? n.i : m.i;
+	}
+
+	switch (id) {
+	case OP_FADDS: r.f = n.f + m.f; break;
+	case OP_FSUBS: r.f = n.f - m.f; break;
+	case OP_FMULS: r.f = n.f * m.f; break;
+	default:       r.f = n.f / m.f; break;
+	}
+	if ((r.i & 0x7FFFFFFF) > 0x7F800000) {
+		return 0x7FC00000;
+	}
+	return r.i;
+}
+
+uint64_t fp_double_op(int id, uint64_t n_bits, uint64_t m_bits) {
+	intdouble n, m, r;
+	n.i = n_bits;
+	m.i = m_bits;
+	int n_nan = (n.i & 0x7FFFFFFFFFFFFFFF) > 0x7FF0000000000000;
+	int m_nan = (m.i & 0x7FFFFFFFFFFFFFFF) > 0x7FF0000000000000;
+	if (n_nan && !(n.i & 0x0008000000000000)) {
+		return n.i | 0x0008000000000000;
+	}
+	if (m_nan && !(m.i & 0x0008000000000000)) {
+		return m.i | 0x0008000000000000;
+	}
+	if (n_nan || m_nan) {
+		return n_nan ? n.i : m.i;
+	}
+
+	switch (id) {
+	case OP_FADDD: r.f = n.f + m.f; break;
+	case OP_FSUBD: r.f = n.f - m.f; break;
+	case OP_FMULD: r.f = n.f * m.f; break;
+	default:       r.f = n.f / m.f; break;
+	}
+	if ((r.i & 0x7FFFFFFFFFFFFFFF) > 0x7FF0000000000000) {
+		return 0x7FF8000000000000;
+	}
+	return r.i;
+}
+
+// FCMP: NZCV 0110 equal, 1000 less, 0010 greater, 0011 unordered.
+// singles compare the same once widened, NaNs included
+void fp_compare(machine_t *m, double a, double b) {
+	if (a != a || b != b) {
+		m->N = 0; m->Z = 0; m->C = 1; m->V = 1;
+	} else if (a == b) {
+		m->N = 0; m->Z = 1; m->C = 1; m->V = 0;
+	} else if (a < b) {
+		m->N = 1; m->Z = 0; m->C = 0; m->V = 0;
+	} else {
+		m->N = 0; m->Z = 0; m->C = 1; m->V = 0;
+	}
+}
 
-	// op2/op: 2 bits [11-10]
-	op.i = (inp_inst.i >> 10) & 0x3;
+// print registers and memory contents. same information as legv8emul's
+// DUMP in a plainer layout: one memory table instead of separate stack
+// and main memory, and HALT counts as an executed instruction
+void dump_machine(machine_t *m) {
+	fprintf(m->out, "Registers:\n");
+	for (int r = 0; r < 32; r++) {
+		fprintf(m->out, "X%d:%s 0x%016lx (%ld)\n", r, (r < 10) ? " " : "", m->X[r], m->X[r]);
+	}
+	// FP registers only when set, so integer programs dump the same as
+	// before. the bits don't say which precision was used, so both the
+	// double and the single in the low half are shown
+	for (int r = 0; r < 32; r++) {
+		if (m->D[r] != 0) {
+			intfloat s;
+			intdouble d;
+			s.i = m->D[r];
+			d.i = m->D[r];
+			fprintf(m->out, "D%d:%s 0x%016lx (D %g, S %g)\n", r, (r < 10) ? " " : "", m->D[r],
+					d.f, (double)s.f);
+		}
+	}
 
-	// Rn: base register: 5 bits [9-5]
-	Rn.i = (inp_inst.i >> 5) & 0x1F;
+	fprintf(m->out, "\nMemory:\n");
+	for (long off = 0; off < m->memory_size; off += 16) {
+		fprintf(m->out, "%08lx ", off);
+		for (int j = 0; j < 16 && off + j < m->memory_size; j++) {
+			fprintf(m->out, " %02x", m->memory[off + j]);
+		}
+		fprintf(m->out, "  |");
+		for (int j = 0; j < 16 && off + j < m->memory_size; j++) {
+			uint8_t c = m->memory[off + j];
+			fprintf(m->out, "%c", (c >= 32 && c < 127 && c != '.') ? c : '.');
+		}
+		fprintf(m->out, "|\n");
+	}
+	fprintf(m->out, "%08lx\n\nInstructions executed: %lu\n", m->memory_size, m->executed);
+}
 
-	// Rt destination/source register: 5 bits [4-0]
-	Rt.i = inp_inst.i & 0x1F;
+// release machine memory, which is either malloc'd or a checkpoint mapping
+void free_machine(machine_t *m) {
+	if (m->memory_mapped) {
+		munmap(m->memory, page_round(m->memory_size));
+	} else {
+		free(m->memory);
+	}
+	m->memory = NULL;
+}
 
-	char str[50];
-	sprintf(str, "%s X%d, [X%d, #%d]", instr.mnemonic, Rt.i, Rn.i, DT_address.i);
-	insert_instruction(str);
+// FNV-1a over the program words, so a checkpoint is only
+// restored against the program it was taken from
+uint32_t program_hash() {
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < num_words; i++) {
+		hash ^= words[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+long page_round(long size) {
+	long page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+// file offset of the memory, which mmap needs page aligned
+long checkpoint_header_size() {
+	return page_round(sizeof(checkpoint_header));
 }
 
-void sort_branches() {
-	for (int b = 1; b < branch_counter; b++) {
-		branch_label temp = branches[b];
-		int key = branches[b].absolute_index;
-		int j = b - 1;
-		while (j >= 0 && branches[j].absolute_index > key) {
-			branches[j+1] = branches[j];
-			j = j-1;
+// write registers, flags and memory to path
+// all-zero pages are skipped and left as holes, so files stay small
+// returns: 0 on success, 1 on error
+int save_checkpoint(machine_t *m, char *path) {
+	checkpoint_header header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, CHECKPOINT_MAGIC);
+	header.pc = m->pc;
+	header.num_words = num_words;
+	header.program_hash = program_hash();
+	header.N = m->N;
+	header.Z = m->Z;
+	header.C = m->C;
+	header.V = m->V;
+	memcpy(header.X, m->X, sizeof(header.X));
+	memcpy(header.D, m->D, sizeof(header.D));
+	header.executed = m->executed;
+	header.memory_size = m->memory_size;
+
+	int cfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (cfd == -1) {
+		perror("Error writing checkpoint");
+		return 1;
+	}
+
+	long mapped_size = page_round(m->memory_size);
+	long page = sysconf(_SC_PAGESIZE);
+	int failed = ftruncate(cfd, checkpoint_header_size() + mapped_size) != 0;
+	if (!failed) {
+		failed = pwrite(cfd, &header, sizeof(header), 0) != sizeof(header);
+	}
+
+	for (long off = 0; !failed && off < m->memory_size; off += page) {
+		long len = m->memory_size - off < page ? m->memory_size - off : page;
+		int zero = 1;
+		for (long j = 0; j < len; j++) {
+			if (m->memory[off + j] != 0) {
+				zero = 0;
+				break;
+			}
+		}
+		if (!zero) {
+			failed = pwrite(cfd, m->memory + off, len, checkpoint_header_size() + off) != len;
 		}
-		branches[j + 1] = temp;
 	}
+
+	if (failed) {
+		perror("Error writing checkpoint");
+	}
+	close(cfd);
+	return failed;
 }
 
-int partition(int first, int last) {
-	instruction_t p = instruction[last];
-	uint32_t pivot = p.opcode;
-	int i = first - 1;
+// load registers and flags from path and map its memory copy-on-write,
+// so resuming costs the same no matter how long the saved prefix was
+// returns: 0 on success, 1 on error
+int restore_checkpoint(machine_t *m, char *path) {
+	checkpoint_header header;
 
-	for (int j = first; j < last; j++) {
-		if (instruction[j].opcode < pivot) {
-			i++;
-			instruction_t temp = instruction[i];
-			instruction[i] = instruction[j];
-			instruction[j] = temp;
+	int cfd = open(path, O_RDONLY);
+	if (cfd == -1) {
+		perror("Error reading checkpoint");
+		return 1;
+	}
+	if (pread(cfd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+		printf("%s is not a checkpoint file\n", path);
+		close(cfd);
+		return 1;
+	}
+	// mapping past the end of the file would fault on first access
+	struct stat buf;
+	if (fstat(cfd, &buf) == -1 || header.memory_size <= 0
+			|| buf.st_size < checkpoint_header_size() + page_round(header.memory_size)) {
+		printf("%s is truncated\n", path);
+		close(cfd);
+		return 1;
+	}
+	if (header.num_words != num_words || header.program_hash != program_hash()) {
+		printf("%s was taken from a different program\n", path);
+		close(cfd);
+		return 1;
+	}
+
+	memset(m, 0, sizeof(machine_t));
+	m->memory = mmap(
+			NULL,
+			page_round(header.memory_size),
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE,
+			cfd,
+			checkpoint_header_size()
+		       );
+	close(cfd);
+	if (m->memory == MAP_FAILED) {
+		perror("Error mapping checkpoint");
+		return 1;
+	}
+
+	m->memory_mapped = 1;
+	m->memory_size = header.memory_size;
+	m->pc = header.pc;
+	m->N = header.N;
+	m->Z = header.Z;
+	m->C = header.C;
+	m->V = header.V;
+	memcpy(m->X, header.X, sizeof(m->X));
+	memcpy(m->D, header.D, sizeof(m->D));
+	m->executed = header.executed;
+	m->words = words;
+	m->op_ids = op_ids;
+	m->num_words = num_words;
+	m->out = stdout;
+	m->err = stderr;
+	return 0;
+}
+
+// NZCV packed into one value, N highest
+int machine_flags(machine_t *m) {
+	return (m->N << 3) | (m->Z << 2) | (m->C << 1) | m->V;
+}
+
+// small magnitudes of either sign become small unsigned values
+uint64_t zigzag(int64_t v) {
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t unzigzag(uint64_t v) {
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// write v 7 bits at a time, low bits first
+// returns: bytes written, at most 10
+int put_varint(unsigned char *out, uint64_t v) {
+	int n = 0;
+	while (v >= 0x80) {
+		out[n++] = v | 0x80;
+		v >>= 7;
+	}
+	out[n++] = v;
+	return n;
+}
+
+// read a varint at data[pos]
+// returns: position after it, or -1 if it runs past len
+long get_varint(unsigned char *data, long len, long pos, uint64_t *v) {
+	*v = 0;
+	for (int shift = 0; pos < len && shift < 64; shift += 7) {
+		unsigned char b = data[pos++];
+		*v |= (uint64_t)(b & 0x7F) << shift;
+		if (b < 0x80) {
+			return pos;
 		}
 	}
-	instruction_t temp = instruction[i + 1];
-	instruction[i + 1] = p; // insert pivot into sorted location
-	instruction[last] = temp;
-	return i+1; // location of sorted location of p
+	return -1;
 }
 
-void quick_sort(int first, int last) {
-	if (first < last) {
-		int p = partition(first, last);
+// create path for --trace, write the header with m's state before the
+// first recorded instruction and start the flusher thread
+// returns: the writer, or NULL on error
+trace_writer *trace_open(char *path, machine_t *m) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("Error writing trace");
+		return NULL;
+	}
 
-		quick_sort(first, p - 1);
-		quick_sort(p + 1, last);
-	}	
+	trace_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.num_words = m->num_words;
+	header.program_hash = program_hash();
+	header.pc = m->pc;
+	header.flags = machine_flags(m);
+	memcpy(header.X, m->X, sizeof(header.X));
+	memcpy(header.D, m->D, sizeof(header.D));
+	if (write_fully(fd, (unsigned char *)&header, sizeof(header)) != 0) {
+		perror("Error writing trace");
+		close(fd);
+		return NULL;
+	}
+
+	trace_writer *t = calloc(1, sizeof(trace_writer));
+	for (int b = 0; b < TRACE_RING; b++) {
+		t->blocks[b] = malloc(TRACE_BLOCK);
+	}
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->changed, NULL);
+	t->block = t->blocks[0];
+	memcpy(t->regs, m->X, sizeof(m->X));
+	memcpy(t->regs + 32, m->D, sizeof(m->D));
+	t->flags = header.flags;
+	t->last_pc = m->pc - 1;
+	t->fd = fd;
+	pthread_create(&t->thread, NULL, trace_flusher, t);
+	return t;
 }
 
-// print the entire 32-bit instruction
-void float_bits(intfloat i) {
-	int j;
-	for (j = 31; j >= 0; j--) {
-		printf("%d", (i.i >> j) & 0x1);
+// append the record of the instruction at pc, which just ran on m.
+// changes are found against the writer's copy of the registers and
+// flags, so the emulator has nothing to save before each instruction
+// address: where it stored to, if it is a store
+void trace_step(machine_t *m, int pc, int64_t address) {
+	trace_writer *t = m->trace;
+	if (t->used + TRACE_RECORD_MAX > TRACE_BLOCK) {
+		trace_hand_over(t);
 	}
-	printf("\n");
+
+	int id = m->op_ids[pc];
+	int Rd = m->words[pc] & 0x1F;
+	int fp = register_prefix(id) != 'X';
+	int dest = (id == OP_BL) ? 30 : Rd + (fp ? 32 : 0);
+	int64_t new_value = fp ? (int64_t)m->D[Rd] : m->X[dest];
+	int flags = machine_flags(m);
+	int64_t old_value = t->regs[dest];
+	int kind = 0;
+	if (new_value != old_value) {
+		kind |= TRACE_REG;
+	}
+	if (id == OP_STUR || id == OP_STURB || id == OP_STURH || id == OP_STURSW
+			|| id == OP_STURS || id == OP_STURD) {
+		kind |= TRACE_STORE;
+	}
+	if (flags != t->flags) {
+		kind |= TRACE_FLAGS;
+	}
+
+	unsigned char *out = t->block + t->used;
+	out += put_varint(out, (zigzag(pc - (t->last_pc + 1)) << 3) | kind);
+	if (kind & TRACE_REG) {
+		*out++ = dest;
+		out += put_varint(out, zigzag((uint64_t)new_value - (uint64_t)old_value));
+		t->regs[dest] = new_value;
+	}
+	if (kind & TRACE_STORE) {
+		int size = access_size(id);
+		uint64_t value = fp ? m->D[Rd] : (uint64_t)m->X[Rd];
+		if (size < 8) {
+			value &= (1ull << (size * 8)) - 1;
+		}
+		out += put_varint(out, zigzag(address - t->last_address));
+		out += put_varint(out, value);
+		t->last_address = address;
+	}
+	if (kind & TRACE_FLAGS) {
+		*out++ = flags;
+		t->flags = flags;
+	}
+	t->used = out - t->block;
+	t->last_pc = pc;
 }
 
-// print the first 11 bits opcode
-// input: 32-bit instruction
-void get_format(intfloat i) {
-	int j;
-	printf("First 11 bits: ");
-	for (j = 31; j >= 21; j--) {
-		printf("%d", (i.i >> j) & 0x1);
+// queue the block being filled for the flusher and start on the next,
+// waiting while every block is still queued
+void trace_hand_over(trace_writer *t) {
+	pthread_mutex_lock(&t->lock);
+	t->lengths[t->tail % TRACE_RING] = t->used;
+	t->tail++;
+	pthread_cond_broadcast(&t->changed);
+	while (t->tail - t->head >= TRACE_RING) {
+		pthread_cond_wait(&t->changed, &t->lock);
+	}
+	pthread_mutex_unlock(&t->lock);
+	t->block = t->blocks[t->tail % TRACE_RING];
+	t->used = 0;
+}
+
+// flusher thread: write queued blocks in order until trace_close
+void *trace_flusher(void *arg) {
+	trace_writer *t = arg;
+	pthread_mutex_lock(&t->lock);
+	while (1) {
+		while (t->head == t->tail && !t->done) {
+			pthread_cond_wait(&t->changed, &t->lock);
+		}
+		if (t->head == t->tail) {
+			break;
+		}
+		int b = t->head % TRACE_RING;
+		pthread_mutex_unlock(&t->lock);
+		if (!t->failed && write_fully(t->fd, t->blocks[b], t->lengths[b]) != 0) {
+			t->failed = 1;
+		}
+		pthread_mutex_lock(&t->lock);
+		t->head++;
+		pthread_cond_broadcast(&t->changed);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+// flush what is left, stop the flusher and close the file
+// returns: 0 on success, 1 if writing failed
+int trace_close(trace_writer *t) {
+	if (t->used > 0) {
+		trace_hand_over(t);
+	}
+	pthread_mutex_lock(&t->lock);
+	t->done = 1;
+	pthread_cond_broadcast(&t->changed);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+
+	int failed = t->failed;
+	if (close(t->fd) != 0) {
+		failed = 1;
+	}
+	if (failed) {
+		perror("Error writing trace");
+	}
+	for (int b = 0; b < TRACE_RING; b++) {
+		free(t->blocks[b]);
+	}
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->changed);
+	free(t);
+	return failed;
+}
+
+// --show-trace: list every instruction recorded in path with the
+// register, store and flags it changed. register values are replayed
+// from the header, so each line shows the full new value
+// returns: 0 on success, 1 on error
+int print_trace(char *path) {
+	struct stat buf;
+	int tfd = open(path, O_RDONLY);
+	if (tfd == -1 || fstat(tfd, &buf) == -1) {
+		perror("Error reading trace");
+		return 1;
+	}
+	long size = buf.st_size;
+	trace_header header;
+	if (size < (long)sizeof(header) || pread(tfd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		printf("%s is not a trace file\n", path);
+		close(tfd);
+		return 1;
+	}
+	if (header.num_words != num_words || header.program_hash != program_hash()) {
+		printf("%s was recorded from a different program\n", path);
+		close(tfd);
+		return 1;
+	}
+	unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, tfd, 0);
+	close(tfd);
+	if (data == MAP_FAILED) {
+		perror("Error mapping trace");
+		return 1;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	// X0-X31, then D0-D31
+	int64_t regs[64];
+	memcpy(regs, header.X, sizeof(header.X));
+	memcpy(regs + 32, header.D, sizeof(header.D));
+	int pc = header.pc - 1;
+	int64_t address = 0;
+	long pos = sizeof(header);
+	while (pos < size) {
+		uint64_t head;
+		uint64_t v;
+		pos = get_varint(data, size, pos, &head);
+		if (pos < 0) {
+			break;
+		}
+		pc += 1 + unzigzag(head >> 3);
+		if (pc < 0 || pc >= num_words) {
+			pos = -1;
+			break;
+		}
+		// effects go in a column after the instruction, if there are any
+		char effects[128];
+		int length = 0;
+		if (head & TRACE_REG) {
+			if (pos >= size) {
+				pos = -1;
+				break;
+			}
+			int r = data[pos++] & 0x3F;
+			if ((pos = get_varint(data, size, pos, &v)) < 0) {
+				break;
+			}
+			regs[r] = (uint64_t)regs[r] + (uint64_t)unzigzag(v);
+			length += sprintf(effects + length, "  %c%d = 0x%016lx", (r < 32) ? 'X' : 'D', r & 0x1F, regs[r]);
+		}
+		if (head & TRACE_STORE) {
+			if ((pos = get_varint(data, size, pos, &v)) < 0) {
+				break;
+			}
+			address += unzigzag(v);
+			if ((pos = get_varint(data, size, pos, &v)) < 0) {
+				break;
+			}
+			length += sprintf(effects + length, "  [0x%lx] = 0x%lx", address, v);
+		}
+		if (head & TRACE_FLAGS) {
+			if (pos >= size) {
+				pos = -1;
+				break;
+			}
+			int flags = data[pos++];
+			length += sprintf(effects + length, "  NZCV = %d%d%d%d", (flags >> 3) & 1, (flags >> 2) & 1, (flags >> 1) & 1, flags & 1);
+		}
+		if (length > 0) {
+			printf("%08x:  %-28s%s\n", pc * 4, instruction_list[pc], effects);
+		} else {
+			printf("%08x:  %s\n", pc * 4, instruction_list[pc]);
+		}
+	}
+
+	munmap(data, size);
+	if (pos < 0) {
+		printf("\n%s ends in the middle of a record\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+// run every program named in list_path, one per line with an optional
+// instruction budget after the path, and print what each one printed
+// in list order. lines starting with # are skipped
+// budget: for lines without one, 0 for no limit
+// returns: 0 if every program halted, 1 otherwise
+int run_batch(char *list_path, uint64_t budget) {
+	FILE *list = (strcmp(list_path, "-") == 0) ? stdin : fopen(list_path, "r");
+	if (list == NULL) {
+		perror("Error reading batch list");
+		return 1;
+	}
+
+	int count = 0;
+	int capacity = 64;
+	batch_task *tasks = malloc(capacity * sizeof(batch_task));
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, list) != -1) {
+		char *path = strtok(line, " \t\r\n");
+		if (path == NULL || path[0] == '#') {
+			continue;
+		}
+		char *limit = strtok(NULL, " \t\r\n");
+		if (count == capacity) {
+			capacity *= 2;
+			tasks = realloc(tasks, capacity * sizeof(batch_task));
+		}
+		memset(&tasks[count], 0, sizeof(batch_task));
+		tasks[count].path = strdup(path);
+		tasks[count].budget = (limit != NULL) ? strtoull(limit, NULL, 10) : budget;
+		count++;
+	}
+	free(line);
+	if (list != stdin) {
+		fclose(list);
+	}
+
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers < 1) {
+		workers = 1;
+	}
+	if (workers > count) {
+		workers = count;
+	}
+
+	// contiguous ranges to start with, stealing evens them out
+	batch_queue *queues = aligned_alloc(64, (workers + 1) * sizeof(batch_queue));
+	batch_worker *states = malloc((workers + 1) * sizeof(batch_worker));
+	pthread_t *ids = malloc((workers + 1) * sizeof(pthread_t));
+	for (int t = 0; t < workers; t++) {
+		uint64_t first = (long)count * t / workers;
+		uint64_t end = (long)count * (t + 1) / workers;
+		atomic_store(&queues[t].range, (first << 32) | end);
+	}
+	for (int t = 0; t < workers; t++) {
+		states[t].tasks = tasks;
+		states[t].queues = queues;
+		states[t].workers = workers;
+		states[t].self = t;
+		pthread_create(&ids[t], NULL, batch_worker_run, &states[t]);
+	}
+	for (int t = 0; t < workers; t++) {
+		pthread_join(ids[t], NULL);
+	}
+
+	const char *endings[] = { "halted", "failed", "out of budget" };
+	int failed = 0;
+	for (int i = 0; i < count; i++) {
+		printf("==> %s: %s after %lu instructions <==\n", tasks[i].path,
+				endings[tasks[i].status], tasks[i].executed);
+		fwrite(tasks[i].output, 1, tasks[i].output_length, stdout);
+		failed |= tasks[i].status != BATCH_HALTED;
+		free(tasks[i].output);
+		free(tasks[i].path);
+	}
+
+	free(ids);
+	free(states);
+	free(queues);
+	free(tasks);
+	return failed;
+}
+
+// worker thread: run tasks from its own range, then stolen ones,
+// until every range is empty. tasks never make new tasks, so once
+// nothing is left to steal nothing ever will be
+void *batch_worker_run(void *arg) {
+	batch_worker *worker = arg;
+	for (;;) {
+		int t = batch_take(&worker->queues[worker->self]);
+		if (t < 0) {
+			t = batch_steal(worker);
+		}
+		if (t < 0) {
+			break;
+		}
+		run_batch_task(&worker->tasks[t]);
+	}
+	return NULL;
+}
+
+// owner side: take the last task of the range
+// returns: task number, or -1 if the range is empty
+int batch_take(batch_queue *queue) {
+	uint64_t range = atomic_load(&queue->range);
+	while ((uint32_t)(range >> 32) < (uint32_t)range) {
+		if (atomic_compare_exchange_weak(&queue->range, &range, range - 1)) {
+			return (uint32_t)range - 1;
+		}
+	}
+	return -1;
+}
+
+// thief side: take the first half of the next non-empty range after
+// this worker's own, run its first task and keep the rest. only the
+// owner stores into an empty range, so that store can't lose a steal
+// returns: task number, or -1 if every range is empty
+int batch_steal(batch_worker *worker) {
+	for (int v = 1; v < worker->workers; v++) {
+		batch_queue *victim = &worker->queues[(worker->self + v) % worker->workers];
+		uint64_t range = atomic_load(&victim->range);
+		uint32_t first = range >> 32;
+		uint32_t end = range;
+		while (first < end) {
+			uint32_t half = (end - first + 1) / 2;
+			uint64_t rest = ((uint64_t)(first + half) << 32) | end;
+			if (atomic_compare_exchange_weak(&victim->range, &range, rest)) {
+				atomic_store(&worker->queues[worker->self].range,
+						((uint64_t)(first + 1) << 32) | (first + half));
+				return first;
+			}
+			first = range >> 32;
+			end = range;
+		}
+	}
+	return -1;
+}
+
+// read, decode and run one batch program on a machine of its own,
+// with its output and runtime errors going to task->output
+void run_batch_task(batch_task *task) {
+	FILE *out = open_memstream(&task->output, &task->output_length);
+	task->status = BATCH_FAILED;
+
+	struct stat buf;
+	int fd = open(task->path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &buf) == -1) {
+		fprintf(out, "%s: %s\n", task->path, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+		}
+		fclose(out);
+		return;
+	}
+	int count = buf.st_size / 4;
+	uint32_t *program = malloc((count + 1) * sizeof(uint32_t));
+	long got = read_fully(fd, (char *)program, (long)count * 4);
+	close(fd);
+	if (got != (long)count * 4) {
+		fprintf(out, "%s: could not read the whole file\n", task->path);
+		free(program);
+		fclose(out);
+		return;
+	}
+
+	// decode in place to host order, with ids the way main does for --run
+	int little = (input_little_endian != -1) ? input_little_endian : guess_little_endian(program, count);
+	uint8_t *ids = malloc(count + 1);
+	for (int i = 0; i < count; i++) {
+		uint32_t w = little ? le32toh(program[i]) : be32toh(program[i]);
+		int idx = find_opcode(w);
+		program[i] = w;
+		ids[i] = (idx > -1) ? instruction[idx].id : OP_INVALID;
+	}
+
+	machine_t m;
+	init_machine(&m);
+	m.words = program;
+	m.op_ids = ids;
+	m.num_words = count;
+	m.limit = task->budget;
+	m.out = out;
+	m.err = out;
+	if (run_program(&m, NULL) == 0) {
+		// still inside the program means the budget stopped it
+		task->status = (m.pc >= 0 && m.pc < count) ? BATCH_OUT_OF_BUDGET : BATCH_HALTED;
+	}
+	task->executed = m.executed;
+
+	free_machine(&m);
+	free(ids);
+	free(program);
+	fclose(out);
+}
+
+// merge execution counts into the disassembly before labels are inserted:
+// each line gets its count, labels of hot targets get marked
+void profile_report(uint64_t *counts) {
+	uint64_t max_count = 0;
+	for (int i = 0; i < num_words; i++) {
+		if (counts[i] > max_count) {
+			max_count = counts[i];
+		}
+	}
+	// anything run at least a tenth as often as the hottest instruction is hot
+	uint64_t hot = max_count / 10;
+	if (hot == 0) {
+		hot = 1;
+	}
+
+	for (int i = 0; i < num_words && i < instruction_counter; i++) {
+		char *line = malloc(strlen(instruction_list[i]) + 24);
+		sprintf(line, "%12lu  %s", counts[i], instruction_list[i]);
+		free(instruction_list[i]);
+		instruction_list[i] = line;
+	}
+
+	// absolute_index is 1-based line number of the labeled instruction
+	for (int b = 0; b < branch_counter; b++) {
+		int target = branches[b].absolute_index - 1;
+		if (target >= 0 && target < num_words && counts[target] >= hot) {
+			char *label = malloc(strlen(branches[b].label) + 40);
+			sprintf(label, "%s    <-- hot (%lu)", branches[b].label, counts[target]);
+			branches[b].label = label;
+		}
 	}
-	printf("\n");
 }
 
-void ADD_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void ADD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void ADDI_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void ADDI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void ADDIS_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void ADDIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void ADDS_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void ADDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void AND_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void AND_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void ANDI_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void ANDI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void ANDIS_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void ANDIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void ANDS_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void ANDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void B_inst(intfloat inp_inst, instruction_t instr) {
-	b_format(inp_inst, instr);
+void B_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	b_format(inp_inst, instr, idx, out);
 }	
 
-void B_cond(intfloat inp_inst, instruction_t instr) {
+void B_cond(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// special case of CB-format
-	cb_format(inp_inst, instr);
+	cb_format(inp_inst, instr, idx, out);
 }
 
-void BL_inst(intfloat inp_inst, instruction_t instr) {
-	b_format(inp_inst, instr);
+void BL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	b_format(inp_inst, instr, idx, out);
 }
 
-void BR_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void BR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void CBNZ_inst(intfloat inp_inst, instruction_t instr) {
-	cb_format(inp_inst, instr);
+void CBNZ_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	cb_format(inp_inst, instr, idx, out);
 }
 
-void CBZ_inst(intfloat inp_inst, instruction_t instr) {
-	cb_format(inp_inst, instr);
+void CBZ_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	cb_format(inp_inst, instr, idx, out);
 }
 
-void DUMP_inst(intfloat inp_inst, instruction_t instr) {
-	//r_format(inp_inst, instr);
+void DUMP_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	//r_format(inp_inst, instr, idx, out);
 	// DUMP doesn't follow normal R-format
-	insert_instruction(instr.mnemonic);
+	strcpy(out, instr.mnemonic);
+}
+
+void EOR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void EORI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
+}
+
+void FADDD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FADDS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FCMPD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FCMPS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FDIVD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FDIVS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void EOR_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void FMULD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void EORI_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void FMULS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void HALT_inst(intfloat inp_inst, instruction_t instr) {
+void FSUBD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void FSUBS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void HALT_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// HALT doesn't follow typical R-format
-	insert_instruction(instr.mnemonic);
+	strcpy(out, instr.mnemonic);
+}
+
+void LDUR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void LDURB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
 }
 
-void LDUR_inst(intfloat inp_inst, instruction_t instr) {
-	d_format(inp_inst, instr);
+void LDURD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
 }
 
-void LSL_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void LDURH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
 }
 
-void LSR_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void LDURS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
 }
 
-void MUL_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void LDURSW_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
 }
 
-void ORR_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void LSL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void ORRI_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void LSR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void PRNL_inst(intfloat inp_inst, instruction_t instr) {
+void MUL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void ORR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void ORRI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
+}
+
+void PRNL_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// PRNL doesn't follow typical R-format
-	insert_instruction(instr.mnemonic);
+	strcpy(out, instr.mnemonic);
 }
 
-void PRNT_inst(intfloat inp_inst, instruction_t instr) {
+void PRNT_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
 	// special case of R-format
-	r_format(inp_inst, instr);
+	r_format(inp_inst, instr, idx, out);
+}
+
+void SDIV_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void SMULH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
+}
+
+void STUR_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void STURB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void STURD_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void STURH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void STURS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void STURW_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	d_format(inp_inst, instr, idx, out);
+}
+
+void SUB_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void STUR_inst(intfloat inp_inst, instruction_t instr) {
-	d_format(inp_inst, instr);
+void SUBI_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void SUB_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void SUBIS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	i_format(inp_inst, instr, idx, out);
 }
 
-void SUBI_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void SUBS_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void SUBIS_inst(intfloat inp_inst, instruction_t instr) {
-	i_format(inp_inst, instr);
+void UDIV_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
-void SUBS_inst(intfloat inp_inst, instruction_t instr) {
-	r_format(inp_inst, instr);
+void UMULH_inst(intfloat inp_inst, instruction_t instr, int idx, char *out) {
+	r_format(inp_inst, instr, idx, out);
 }
 
 